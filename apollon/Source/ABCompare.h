@@ -0,0 +1,95 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+//==============================================================================
+/**
+    Switches a processor's output between what it made and what it was given, without stopping it.
+
+    The input is kept in a delay line as long as the processor's latency, so the original is heard
+    exactly in step with the processed audio it replaces. The processor carries on running on both
+    sides of the switch, so there is nothing to re-prime or re-seek when switching back. Each switch
+    crossfades within the next block.
+
+    prepare() is called on the message thread while the graph is stopped, the rest on the audio
+    thread, which never allocates.
+*/
+//==============================================================================
+class ABCompare {
+public:
+
+    void prepare (int latencySamples, int numChannels, int blockSize) {
+        delay = jmax (0, latencySamples);
+        line.setSize (numChannels, nextPowerOfTwo (delay + blockSize + 1));
+        line.clear();
+        mask = line.getNumSamples() - 1;
+        writePos = 0;
+
+        original.setSize (numChannels, blockSize);
+        gain = showingOriginal ? 1.0f : 0.0f;
+    }
+
+    // Switches to the original or back to the processed audio, from the next block.
+    void setShowingOriginal (bool shouldShowOriginal) noexcept {
+        showingOriginal = shouldShowOriginal;
+    }
+
+    bool isShowingOriginal() const noexcept {
+        return showingOriginal.load();
+    }
+
+    // Keeps the block's input. Call it before the block is processed.
+    void pushInput (const AudioBuffer<float>& block, int startSample, int numSamples) noexcept {
+        const int channels = jmin (block.getNumChannels(), line.getNumChannels());
+
+        for (int i = 0; i < numSamples; ++i) {
+            for (int ch = 0; ch < channels; ++ch)
+                line.setSample (ch, (writePos + i) & mask, block.getSample (ch, startSample + i));
+        }
+
+        writePos = (writePos + numSamples) & mask;
+    }
+
+    // Mixes the delayed input back in over the processed block, fading if the switch just changed.
+    void apply (AudioBuffer<float>& block, int startSample, int numSamples) noexcept {
+        const float target = showingOriginal.load() ? 1.0f : 0.0f;
+
+        // Only the processed audio is heard, and it's staying that way.
+        if (gain == 0.0f && target == 0.0f)
+            return;
+
+        const int channels = jmin (block.getNumChannels(), line.getNumChannels());
+        const int readStart = writePos - numSamples - delay;
+        const float startGain = gain;
+
+        for (int done = 0; done < numSamples;) {
+            const int n = jmin (numSamples - done, original.getNumSamples());
+
+            if (n <= 0)
+                break;
+
+            // The fade spans the whole block however many pieces it's mixed in.
+            const float from = startGain + (target - startGain) * (float) done / (float) numSamples;
+            const float to = startGain + (target - startGain) * (float) (done + n) / (float) numSamples;
+
+            for (int ch = 0; ch < channels; ++ch) {
+                for (int i = 0; i < n; ++i)
+                    original.setSample (ch, i, line.getSample (ch, (readStart + done + i) & mask));
+
+                block.applyGainRamp (ch, startSample + done, n, 1.0f - from, 1.0f - to);
+                block.addFromWithRamp (ch, startSample + done, original.getReadPointer (ch), n, from, to);
+            }
+
+            done += n;
+        }
+
+        gain = target;
+    }
+
+private:
+    AudioBuffer<float> line, original;
+    int delay = 0, mask = 0, writePos = 0;
+    float gain = 0.0f;
+    std::atomic<bool> showingOriginal { false };
+};
+//==============================================================================
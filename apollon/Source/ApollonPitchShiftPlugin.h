@@ -0,0 +1,371 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "Tracing.h"
+#include "RealtimeGuard.h"
+#include "ThreadPolicy.h"
+#include "Playhead.h"
+#include "RenderAhead.h"
+#include "LiveInput.h"
+#include "PitchAutomation.h"
+#include "ABCompare.h"
+
+namespace te = tracktion_engine;
+
+//==============================================================================
+/**
+        Maps incoming MIDI messages onto a transposition in semitones and onto transport commands.
+        Called from the audio thread, so it must never allocate or lock.
+*/
+//==============================================================================
+struct MidiPitchMapping {
+
+    enum class TransportCommand { none, play, stop, toggle };
+
+    int transposeController = 4;     // CC that sweeps the whole transposition range (CC 4 is the standard foot controller).
+    int toggleController    = 80;    // CC that toggles play/pause when pressed (i.e. value >= 64).
+    int rootNote            = 60;    // Note that maps to no transposition, other notes transpose relative to it.
+    float pitchBendRange    = 2.0f;  // Semitones covered by a full pitch-bend throw in either direction.
+
+    // Updates semitones from the message, clamped to limits. Returns the transport command the message triggers, if any.
+    TransportCommand apply (const MidiMessage& m, float& semitones, Range<float> limits) const noexcept {
+        if (m.isController()) {
+            if (m.getControllerNumber() == transposeController)
+                semitones = jmap (m.getControllerValue() / 127.0f, limits.getStart(), limits.getEnd());
+            else if (m.getControllerNumber() == toggleController && m.getControllerValue() >= 64)
+                return TransportCommand::toggle;
+        }
+        else if (m.isPitchWheel()) {
+            semitones = limits.clipValue ((m.getPitchWheelValue() - 8192) / 8192.0f * pitchBendRange);
+        }
+        else if (m.isNoteOn()) {
+            semitones = limits.clipValue ((float) (m.getNoteNumber() - rootNote));
+        }
+        else if (m.isMidiStart() || m.isMidiContinue()) {
+            return TransportCommand::play;
+        }
+        else if (m.isMidiStop()) {
+            return TransportCommand::stop;
+        }
+
+        return TransportCommand::none;
+    }
+};
+//==============================================================================
+/**
+    PitchShiftPlugin that also listens to the MIDI routed into its track.
+    Each event is applied at its own sample offset by splitting the block around it, so the
+    transposition changes exactly where the event happened rather than at the next message-thread tick.
+
+    In render-ahead mode live playback is shifted ahead of time on a background thread instead,
+    and the block is just copied out of its queue. In live-input mode the track's input is shifted
+    by a DelayLineShifter, trading some smoothness for a delay of a few milliseconds. Renders always
+    use the plugin's own stretcher.
+
+    While the transport plays, the transposition follows the pitch automation from the start of
+    each block, and MIDI can still move it within the block. The render-ahead queue is refilled
+    whenever the transposition changes, so it's left off while there is a curve to follow.
+
+    Live playback can be switched to the original audio and back at any time. The stretcher keeps
+    running either way, and the original is delayed by the plugin's latency so both line up.
+*/
+//==============================================================================
+class ApollonPitchShiftPlugin  : public te::PitchShiftPlugin,
+                                 private Timer {
+public:
+
+    ApollonPitchShiftPlugin (te::PluginCreationInfo info)
+        : te::PitchShiftPlugin (info) {
+        renderAheadEnabled.referTo (state, "renderAhead", getUndoManager(), false);
+        liveInputEnabled.referTo (state, "liveInput", getUndoManager(), false);
+
+        // Drawing the first point or removing the last switches render-ahead off or back on.
+        automation.onEmptyChanged = [this] {
+            if (renderAheadEnabled.get())
+                edit.restartPlayback();
+        };
+
+        // The audio thread only publishes changes, they're picked up from here.
+        startTimerHz (30);
+    }
+
+    ~ApollonPitchShiftPlugin() override {
+        stopTimer();
+    }
+
+    static inline const char* xmlTypeName = "apollonPitchShift";
+
+    juce::String getName() override                     { return TRANS("Pitch Shifter"); }
+    juce::String getPluginType() override               { return xmlTypeName; }
+
+    MidiPitchMapping midiMapping;
+
+    // Where live playback is, published at the start of every block for the cursor to follow.
+    PlayheadClock playhead;
+
+    // Whether live playback is rendered ahead, saved with the session.
+    juce::CachedValue<bool> renderAheadEnabled;
+
+    // Returns the track's pitch shifter, inserting one at the start of its plugin list if there isn't one yet.
+    static ApollonPitchShiftPlugin* getOrInsert (te::AudioTrack& track) {
+        if (auto existing = track.pluginList.findFirstPluginOfType<ApollonPitchShiftPlugin>())
+            return existing;
+
+        auto plugin = track.edit.getPluginCache().createNewPlugin (xmlTypeName, {});
+        track.pluginList.insertPlugin (plugin, 0, nullptr);
+
+        return dynamic_cast<ApollonPitchShiftPlugin*> (plugin.get());
+    }
+
+    // Called on the message thread when a MIDI message asks for a transport change.
+    std::function<void (MidiPitchMapping::TransportCommand)> onTransportCommand;
+
+    // Switches render-ahead mode on or off, restarting playback so the graph picks up the change in latency.
+    void setRenderAhead (bool shouldRenderAhead) {
+        renderAheadEnabled = shouldRenderAhead;
+        edit.restartPlayback();
+    }
+
+    juce::CachedValue<bool> liveInputEnabled;
+
+    // Switches live-input mode on or off. Routing the input to the track is up to the caller.
+    void setLiveInput (bool shouldUseLiveInput) {
+        liveInputEnabled = shouldUseLiveInput;
+        edit.restartPlayback();
+    }
+
+    // Switches live playback between the original and the transposed audio, crossfading within a block.
+    void setShowingOriginal (bool shouldShowOriginal) noexcept {
+        abCompare.setShowingOriginal (shouldShowOriginal);
+    }
+
+    bool isShowingOriginal() const noexcept {
+        return abCompare.isShowingOriginal();
+    }
+
+    // The transposition over time, saved with the session.
+    PitchCurve automation { state, getUndoManager() };
+
+    // Returns the delay the live shifter adds, whether or not it's in use.
+    double getLiveLatencySeconds() const noexcept {
+        return liveShifter.getLatencySeconds();
+    }
+
+    // Passes the track's clip and the transport's loop to the render-ahead thread. Call it when either changes.
+    void updateRenderAheadSource() {
+        if (! renderingAhead)
+            return;
+
+        auto track = dynamic_cast<te::AudioTrack*> (getOwnerTrack());
+        auto clip = track != nullptr ? dynamic_cast<te::WaveAudioClip*> (track->getClips().getFirst()) : nullptr;
+
+        if (clip == nullptr)
+            return;
+
+        auto& transport = edit.getTransport();
+        const auto pos = clip->getPosition();
+        const auto file = clip->getPlaybackFile().getFile();
+
+        renderAhead.setSource (file.existsAsFile() ? file : clip->getOriginalFile(), pos.getStart(), pos.getOffset(),
+                               transport.getLoopRange(), transport.looping);
+    }
+
+    void initialise (const te::PluginInitialisationInfo& info) override {
+        te::PitchShiftPlugin::initialise (info);
+        preallocateScratchBuffers (info.blockSizeSamples);
+
+        liveInput = liveInputEnabled.get();
+        liveShifter.prepare (info.sampleRate, 2);
+
+        // Live input has nothing to render ahead of, and automation would refill the queue every block.
+        renderingAhead = renderAheadEnabled.get() && ! liveInput && automation.isEmpty();
+
+        if (renderingAhead) {
+            renderAhead.prepare (info.sampleRate, 2, (te::TimeStretcher::Mode) mode.get());
+            updateRenderAheadSource();
+        }
+        else {
+            renderAhead.stop();
+        }
+
+        // The latency depends on the mode, so this comes last.
+        abCompare.prepare (roundToInt (getLatencySeconds() * info.sampleRate), 2, info.blockSizeSamples);
+    }
+
+    void deinitialise() override {
+        renderAhead.stop();
+        te::PitchShiftPlugin::deinitialise();
+    }
+
+    // Rendered-ahead output is already aligned with the edit, so there is no delay to compensate.
+    double getLatencySeconds() override {
+        if (liveInput)
+            return liveShifter.getLatencySeconds();
+
+        return renderingAhead ? 0.0 : te::PitchShiftPlugin::getLatencySeconds();
+    }
+
+    void applyToBuffer (const te::PluginRenderContext& fc) override {
+        APOLLON_TRACE_ZONE ("pitch shift");
+
+        // Graph workers are only reachable from the nodes they run, so they pick up the thread policy here.
+        if (! fc.isRendering)
+            ThreadPolicy::applyToAudioThread();
+
+        RealtimeGuard::ScopedAudioThread audioThread (! fc.isRendering);
+
+        if (! fc.isRendering)
+            playhead.publish (fc.editTime.getStart(), fc.isPlaying);
+
+        if (fc.isPlaying || fc.isRendering)
+            followAutomation (fc);
+
+        // Renders are always the processed audio.
+        const bool comparing = ! fc.isRendering && fc.destBuffer != nullptr;
+
+        if (comparing)
+            abCompare.pushInput (*fc.destBuffer, fc.bufferStartSample, fc.bufferNumSamples);
+
+        processBlock (fc);
+
+        if (comparing)
+            abCompare.apply (*fc.destBuffer, fc.bufferStartSample, fc.bufferNumSamples);
+    }
+
+private:
+    std::atomic<float> changedSemitones { 0.0f };
+    std::atomic<bool> semitonesChanged { false };
+    std::atomic<int> pendingCommand { (int) MidiPitchMapping::TransportCommand::none };
+
+    RenderAheadBuffer renderAhead { engine };
+    bool renderingAhead = false;
+
+    DelayLineShifter liveShifter;
+    bool liveInput = false;
+
+    ABCompare abCompare;
+
+    // Shifts the block, splitting it around any MIDI that moves the transposition.
+    void processBlock (const te::PluginRenderContext& fc) {
+        auto* midi = fc.bufferForMidiMessages;
+        const bool fromQueue = renderingAhead && ! fc.isRendering;
+
+        // Nothing to split, process the whole block in one go.
+        if (midi == nullptr || midi->isEmpty()) {
+            if (fromQueue)
+                readRenderedAhead (fc);
+            else if (liveInput && ! fc.isRendering)
+                processRange (fc, 0, fc.bufferNumSamples);
+            else
+                te::PitchShiftPlugin::applyToBuffer (fc);
+
+            return;
+        }
+
+        midi->sortByTimestamp();
+
+        const auto limits = Range<float> (semitones->valueRange.start, semitones->valueRange.end);
+        auto value = semitones->getCurrentValue();
+        int start = 0;
+
+        for (auto& m : *midi) {
+            // Timestamps are in seconds relative to the start of this block.
+            const int offset = jlimit (start, fc.bufferNumSamples, roundToInt (m.getTimeStamp() * sampleRate));
+
+            // The queue is refilled whole whenever the transposition changes, so it isn't split.
+            if (! fromQueue) {
+                processRange (fc, start, offset - start);
+                start = offset;
+            }
+
+            const auto command = midiMapping.apply (m, value, limits);
+
+            if (value != semitones->getCurrentValue()) {
+                semitones->setParameter (value, juce::dontSendNotification);
+                changedSemitones = value;
+                semitonesChanged = true;
+            }
+
+            if (command != MidiPitchMapping::TransportCommand::none)
+                pendingCommand = (int) command;
+        }
+
+        fromQueue ? readRenderedAhead (fc) : processRange (fc, start, fc.bufferNumSamples - start);
+    }
+
+    // Sets the transposition from the automation at the start of the block, unless the slider is being held.
+    void followAutomation (const te::PluginRenderContext& fc) {
+        float value;
+
+        if (automation.isTouched() || ! automation.lookup (fc.editTime.getStart(), value) || value == semitones->getCurrentValue())
+            return;
+
+        semitones->setParameter (value, juce::dontSendNotification);
+
+        // Exports render a copy of the edit (see ExportJob), so this is that copy's own parameter,
+        // and there is no slider to update.
+        if (! fc.isRendering) {
+            changedSemitones = value;
+            semitonesChanged = true;
+        }
+    }
+
+    // Replaces the block with the queued output of the render-ahead thread.
+    void readRenderedAhead (const te::PluginRenderContext& fc) {
+        if (fc.destBuffer != nullptr)
+            renderAhead.read (*fc.destBuffer, fc.bufferStartSample, fc.bufferNumSamples,
+                              fc.editTime.getStart(), fc.isPlaying, semitones->getCurrentValue());
+    }
+
+    // Stocks the engine's scratch buffer pool before playback starts. te::AudioScratchBuffer allocates
+    // whenever it finds the pool empty, which on the audio thread is a click waiting to happen. Whether
+    // anything on the stretch path still allocates is what the regression run's real-time check reports.
+    static void preallocateScratchBuffers (int blockSize) {
+        static constexpr int numBuffers = 4;
+        const int numSamples = jmax (blockSize, 8192);
+
+        std::vector<std::unique_ptr<te::AudioScratchBuffer>> buffers;
+
+        for (int i = 0; i < numBuffers; ++i)
+            buffers.push_back (std::make_unique<te::AudioScratchBuffer> (2, numSamples));
+
+        // Going out of scope hands them back to the pool, where they stay for the audio thread to reuse.
+    }
+
+    // Runs the pitch shifter over a sub-range of the block, shifting the edit time to match.
+    void processRange (const te::PluginRenderContext& fc, int startSample, int numSamples) {
+        if (numSamples <= 0)
+            return;
+
+        if (liveInput && ! fc.isRendering) {
+            if (fc.destBuffer != nullptr)
+                liveShifter.process (*fc.destBuffer, fc.bufferStartSample + startSample, numSamples, semitones->getCurrentValue());
+
+            return;
+        }
+
+        auto sub = fc;
+        sub.bufferStartSample += startSample;
+        sub.bufferNumSamples = numSamples;
+        sub.bufferForMidiMessages = nullptr;
+        sub.editTime = te::EditTimeRange (fc.editTime.getStart() + startSample / sampleRate,
+                                          fc.editTime.getStart() + (startSample + numSamples) / sampleRate);
+
+        te::PitchShiftPlugin::applyToBuffer (sub);
+    }
+
+    // Syncs the stored parameter value (and therefore the slider) and runs transport commands on the message thread.
+    // Polled, because posting a message from the audio thread can allocate and lock.
+    void timerCallback() override {
+        if (semitonesChanged.exchange (false))
+            semitones->setParameter (changedSemitones.load(), juce::sendNotificationSync);
+
+        const auto command = (MidiPitchMapping::TransportCommand) pendingCommand.exchange ((int) MidiPitchMapping::TransportCommand::none);
+
+        if (command != MidiPitchMapping::TransportCommand::none && onTransportCommand != nullptr)
+            onTransportCommand (command);
+    }
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (ApollonPitchShiftPlugin)
+};
+//==============================================================================
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+namespace te = tracktion_engine;
+
+//==============================================================================
+/**
+    The app's own settings, read and written through the engine's property storage when there is
+    an engine, or straight from the settings file when there isn't.
+
+    The settings file is the one tracktion's PropertyStorage keeps, opened with the same options,
+    so single-instance mode and the headless settings commands can change a setting without
+    starting an engine and the next launch still finds it. Inside the app everything goes through
+    the engine instead: two PropertiesFile objects on the same file would each save over the other.
+*/
+//==============================================================================
+class AppSettings {
+public:
+
+    // Reads and writes the engine's property storage.
+    AppSettings (te::Engine& e) : engine (&e) {}
+
+    // Reads and writes the settings file directly, for when there is no engine.
+    AppSettings() = default;
+
+    // Returns the stored value, or a void var if there isn't one.
+    var get (const String& key) const {
+        if (engine != nullptr)
+            return engine->getPropertyStorage().getCustomProperty (key);
+
+        auto& file = getFile();
+        return file.containsKey (key) ? var (file.getValue (key)) : var();
+    }
+
+    // Stores a value for this and future launches.
+    void set (const String& key, const var& value) {
+        if (engine != nullptr) {
+            engine->getPropertyStorage().setCustomProperty (key, value);
+            return;
+        }
+
+        auto& file = getFile();
+        file.setValue (key, value);
+        file.saveIfNeeded();
+    }
+
+    // The settings file itself, only for use while no engine exists.
+    static PropertiesFile& getFile() {
+        static PropertiesFile file ([] {
+            PropertiesFile::Options o;
+            o.applicationName = ProjectInfo::projectName;
+            o.filenameSuffix = ".settings";
+            o.folderName = ProjectInfo::projectName;
+            o.osxLibrarySubFolder = "Application Support";
+            return o;
+        }());
+
+        return file;
+    }
+
+private:
+    te::Engine* engine = nullptr;
+};
+//==============================================================================
@@ -0,0 +1,241 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "Export.h"
+
+namespace te = tracktion_engine;
+
+//==============================================================================
+/**
+    Batch rendering spread across worker processes, run with
+        apollon --batch <folder or list file> <output folder> [--semitones n] [--workers n]
+
+    The coordinator keeps a queue of files and hands them one at a time to N copies of this
+    executable started as workers. Each worker has its own te::Engine and builds the usual pitch
+    chain for every job, so workers share nothing. If a worker crashes, or takes longer than
+    jobTimeoutSeconds, only its current file fails: the process is replaced and the batch goes on.
+*/
+//==============================================================================
+namespace Batch {
+
+    inline const char* workerCommandLineId = "apollon-batch-worker";
+
+    //==============================================================================
+    // Runs inside a worker process, rendering each job it is sent and replying with the outcome.
+    class Worker  : public ChildProcessWorker {
+    public:
+
+        // Returns a worker if this process was launched as one, nullptr otherwise.
+        static std::unique_ptr<Worker> createIfRequested (const String& commandLine) {
+            auto worker = std::make_unique<Worker>();
+
+            if (worker->initialiseFromCommandLine (commandLine, workerCommandLineId))
+                return worker;
+
+            return nullptr;
+        }
+
+        // Messages arrive on the connection's thread, but tracktion has to be driven from the message thread.
+        void handleMessageFromCoordinator (const MemoryBlock& message) override {
+            MessageManager::callAsync ([this, job = ValueTree::fromXml (message.toString())] { render (job); });
+        }
+
+        void handleConnectionLost() override {
+            MessageManager::callAsync ([] { JUCEApplicationBase::quit(); });
+        }
+
+    private:
+        std::unique_ptr<te::Engine> engine;
+
+        void render (const ValueTree& job) {
+            if (engine == nullptr) {
+                engine = std::make_unique<te::Engine> (ProjectInfo::projectName);
+                engine->getPluginManager().createBuiltInType<ApollonPitchShiftPlugin>();
+            }
+
+            const auto error = ExportJob::renderFile (*engine, File (job["input"].toString()), (float) job["semitones"],
+                                                      File (job["output"].toString()));
+
+            ValueTree result ("RESULT");
+            result.setProperty ("id", job["id"], nullptr);
+            result.setProperty ("error", error, nullptr);
+
+            const auto text = result.toXmlString();
+            sendMessageToCoordinator (MemoryBlock (text.toRawUTF8(), text.getNumBytesAsUTF8()));
+        }
+    };
+
+    //==============================================================================
+    // Fans the jobs out to the workers and collects their results.
+    class Coordinator {
+    public:
+
+        struct Job {
+            File input, output;
+            String error;
+            bool finished = false;
+        };
+
+        double jobTimeoutSeconds = 30.0 * 60.0;
+
+        Coordinator (Array<File> inputs, const File& outputFolder, float shiftSemitones, int numWorkers)
+            : semitones (shiftSemitones) {
+            outputFolder.createDirectory();
+
+            for (auto& f : inputs)
+                jobs.add ({ f, outputFolder.getChildFile (f.getFileNameWithoutExtension() + " (transposed).wav") });
+
+            for (int i = 0; i < jmax (1, numWorkers); ++i)
+                slots.add (new Slot());
+        }
+
+        // Returns the audio files in a folder, or the files listed one per line in a text file.
+        static Array<File> findInputs (const File& folderOrList, te::Engine& engine) {
+            if (folderOrList.isDirectory()) {
+                auto files = folderOrList.findChildFiles (File::findFiles, false, engine.getAudioFileFormatManager().readFormatManager.getWildcardForAllFormats());
+                files.sort();
+                return files;
+            }
+
+            Array<File> files;
+            StringArray lines;
+            lines.addLines (folderOrList.loadFileAsString());
+
+            for (auto& line : lines)
+                if (line.trim().isNotEmpty())
+                    files.add (folderOrList.getParentDirectory().getChildFile (line.trim().unquoted()));
+
+            return files;
+        }
+
+        // Runs every job to completion, printing a line per file. Returns the number of failures.
+        int run() {
+            int next = 0, completed = 0;
+
+            while (completed < jobs.size()) {
+                for (auto* slot : slots) {
+                    if (slot->jobIndex >= 0 && collect (*slot))
+                        ++completed;
+
+                    if (slot->jobIndex < 0 && next < jobs.size() && ! dispatch (*slot, next++))
+                        ++completed;
+                }
+
+                Thread::sleep (20);
+            }
+
+            int failures = 0;
+
+            for (auto& job : jobs)
+                if (job.error.isNotEmpty())
+                    ++failures;
+
+            log (String (jobs.size() - failures) + " rendered, " + String (failures) + " failed");
+            return failures;
+        }
+
+    private:
+        //==============================================================================
+        // One worker process and the job it is working on. The result is written by the connection thread.
+        struct Slot  : public ChildProcessCoordinator {
+            bool isRunning = false;
+            int jobIndex = -1;
+            double startedMs = 0.0;
+
+            CriticalSection lock;
+            bool replied = false, lost = false;
+            String error;
+
+            void handleMessageFromWorker (const MemoryBlock& message) override {
+                const auto result = ValueTree::fromXml (message.toString());
+                const ScopedLock sl (lock);
+                error = result["error"].toString();
+                replied = true;
+            }
+
+            void handleConnectionLost() override {
+                const ScopedLock sl (lock);
+                lost = true;
+            }
+        };
+
+        const float semitones;
+        Array<Job> jobs;
+        OwnedArray<Slot> slots;
+
+        static void log (const String& message) {
+            std::cout << message << std::endl;
+        }
+
+        // Sends a job to the slot's worker, starting a new process if it has none. Returns false if the job failed to start.
+        bool dispatch (Slot& slot, int index) {
+            auto& job = jobs.getReference (index);
+
+            if (! slot.isRunning)
+                slot.isRunning = slot.launchWorkerProcess (File::getSpecialLocation (File::currentExecutableFile), workerCommandLineId, 0, 0);
+
+            if (! slot.isRunning) {
+                finish (index, TRANS("Couldn't start a worker process"));
+                return false;
+            }
+
+            ValueTree message ("JOB");
+            message.setProperty ("id", index, nullptr);
+            message.setProperty ("input", job.input.getFullPathName(), nullptr);
+            message.setProperty ("output", job.output.getFullPathName(), nullptr);
+            message.setProperty ("semitones", semitones, nullptr);
+
+            const auto text = message.toXmlString();
+
+            {
+                const ScopedLock sl (slot.lock);
+                slot.replied = slot.lost = false;
+                slot.error.clear();
+            }
+
+            slot.jobIndex = index;
+            slot.startedMs = Time::getMillisecondCounterHiRes();
+            slot.sendMessageToWorker (MemoryBlock (text.toRawUTF8(), text.getNumBytesAsUTF8()));
+            return true;
+        }
+
+        // Checks on the slot's job. Returns true if it has ended, one way or another.
+        bool collect (Slot& slot) {
+            bool replied, lost;
+            String error;
+
+            {
+                const ScopedLock sl (slot.lock);
+                replied = slot.replied;
+                lost = slot.lost;
+                error = slot.error;
+            }
+
+            const bool timedOut = Time::getMillisecondCounterHiRes() - slot.startedMs > jobTimeoutSeconds * 1000.0;
+
+            if (! replied && ! lost && ! timedOut)
+                return false;
+
+            if (! replied) {
+                // The worker died or hung, so it can't be trusted with the next job. Killing it here means the next dispatch starts a fresh one.
+                error = lost ? TRANS("Worker crashed") : TRANS("Timed out");
+                slot.killWorkerProcess();
+                slot.isRunning = false;
+                jobs.getReference (slot.jobIndex).output.deleteFile();
+            }
+
+            finish (slot.jobIndex, error);
+            slot.jobIndex = -1;
+            return true;
+        }
+
+        void finish (int index, const String& error) {
+            auto& job = jobs.getReference (index);
+            job.error = error;
+            job.finished = true;
+
+            log ((error.isEmpty() ? "OK   " : "FAIL ") + job.input.getFileName() + (error.isEmpty() ? String() : ": " + error));
+        }
+    };
+}
+//==============================================================================
@@ -0,0 +1,312 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "Tracing.h"
+#include "RealtimeGuard.h"
+#include "ThreadPolicy.h"
+
+namespace te = tracktion_engine;
+
+//==============================================================================
+/**
+    Chain of built-in effects run after the pitch shifter, each timed on every block.
+
+    The effects live inside this plugin's state, so they are saved with the session, and they
+    are driven directly rather than through the track's plugin list so each one can be timed.
+    An effect whose smoothed time per block goes over its share of the block's duration is
+    bypassed automatically, fading from its output to its input over one block so nothing clicks.
+    It stays bypassed until it is switched back on.
+
+    The effects in the state are the chain: the slots the audio thread runs are rebuilt from them
+    whenever one is added or removed, so undoing or redoing a change puts the chain back with it.
+    That only ever happens on the message thread, under a spin lock the audio thread merely
+    tries. A block that arrives mid-change passes through untouched.
+*/
+//==============================================================================
+class EffectsChainPlugin  : public te::Plugin {
+public:
+
+    EffectsChainPlugin (te::PluginCreationInfo info)
+        : te::Plugin (info) {
+        cpuBudget.referTo (state, "cpuBudget", getUndoManager(), 0.25f);
+
+        // Pick up the effects saved with the session.
+        for (auto child : state)
+            if (child.hasType (te::IDs::PLUGIN))
+                if (auto p = edit.getPluginCache().getOrCreatePluginFor (child))
+                    slots.add (new Slot (p));
+
+        stateListener = std::make_unique<StateListener> (*this);
+    }
+
+    ~EffectsChainPlugin() override {
+        stateListener.reset();
+        notifyListenersOfDeletion();
+    }
+
+    static inline const char* xmlTypeName = "apollonEffectsChain";
+
+    juce::String getName() override                                 { return TRANS("Effects"); }
+    juce::String getPluginType() override                           { return xmlTypeName; }
+    juce::String getShortName (int) override                        { return TRANS("FX"); }
+    juce::String getSelectableDescription() override                { return getName(); }
+    bool needsConstantBufferSize() override                         { return false; }
+    int getNumOutputChannelsGivenInputs (int numInputChannels) override { return numInputChannels; }
+
+    // Fraction of each block's duration a single effect may use before it is bypassed.
+    juce::CachedValue<float> cpuBudget;
+
+    // The effects that can be added: tracktion's own, then the bundled airwindows ones.
+    struct AvailableEffect {
+        const char* type;
+        const char* name;
+    };
+
+    static Array<AvailableEffect> getAvailableEffects() {
+        return { { te::ReverbPlugin::xmlTypeName,           "Reverb" },
+                 { te::DelayPlugin::xmlTypeName,            "Delay" },
+                 { te::ChorusPlugin::xmlTypeName,           "Chorus" },
+                 { te::PhaserPlugin::xmlTypeName,           "Phaser" },
+                 { te::CompressorPlugin::xmlTypeName,       "Compressor" },
+                 { te::EqualiserPlugin::xmlTypeName,        "EQ" },
+                 { te::LowPassPlugin::xmlTypeName,          "Low/High Pass" },
+                 { te::AirWindowsDeess::xmlTypeName,        "airwindows DeEss" },
+                 { te::AirWindowsButterComp::xmlTypeName,   "airwindows ButterComp" },
+                 { te::AirWindowsPurestDrive::xmlTypeName,  "airwindows PurestDrive" },
+                 { te::AirWindowsToTape6::xmlTypeName,      "airwindows ToTape6" },
+                 { te::AirWindowsChorus::xmlTypeName,       "airwindows Chorus" },
+                 { te::AirWindowsTapeDelay::xmlTypeName,    "airwindows TapeDelay" },
+                 { te::AirWindowsPocketVerbs::xmlTypeName,  "airwindows PocketVerbs" },
+                 { te::AirWindowsWider::xmlTypeName,        "airwindows Wider" } };
+    }
+
+    // Returns the track's chain, inserting one straight after the given plugin if there isn't one yet.
+    static EffectsChainPlugin* getOrInsert (te::AudioTrack& track, te::Plugin& after) {
+        if (auto existing = track.pluginList.findFirstPluginOfType<EffectsChainPlugin>())
+            return existing;
+
+        auto plugin = track.edit.getPluginCache().createNewPlugin (xmlTypeName, {});
+        track.pluginList.insertPlugin (plugin, track.pluginList.indexOf (&after) + 1, nullptr);
+
+        return dynamic_cast<EffectsChainPlugin*> (plugin.get());
+    }
+
+    //==============================================================================
+    // What the UI shows for each effect.
+    struct EffectInfo {
+        String name;
+        float microsPerBlock, load;
+        bool bypassed, autoBypassed;
+    };
+
+    int getNumEffects() const                   { return slots.size(); }
+
+    EffectInfo getEffectInfo (int index) const {
+        auto* s = slots[index];
+
+        if (s == nullptr)
+            return {};
+
+        return { s->plugin->getName(), s->microsPerBlock.load(), s->load.load(), s->bypassed.load(), s->autoBypassed.load() };
+    }
+
+    // Appends a new effect of the given type to the end of the chain.
+    void addEffect (const String& type) {
+        if (auto p = edit.getPluginCache().createNewPlugin (type, {}))
+            state.appendChild (p->state, getUndoManager());
+    }
+
+    // Removes an effect from the chain, and from the session.
+    void removeEffect (int index) {
+        if (auto* s = slots[index])
+            state.removeChild (s->plugin->state, getUndoManager());
+    }
+
+    // Returns true if every effect has been switched off, or there are none, so the chain passes its input through unchanged.
+    bool isTransparent() const {
+        for (auto* s : slots)
+            if (! s->bypassed.load())
+                return false;
+
+        return true;
+    }
+
+    // Bypasses an effect, or switches it back on. Either way it crossfades over the next block.
+    void setBypassed (int index, bool shouldBeBypassed) {
+        if (auto* s = slots[index]) {
+            s->bypassed = shouldBeBypassed;
+            s->autoBypassed = false;
+            s->load = 0.0f;
+        }
+    }
+
+    //==============================================================================
+    double getLatencySeconds() override {
+        double latency = 0.0;
+
+        for (auto* s : slots)
+            latency += s->plugin->getLatencySeconds();
+
+        return latency;
+    }
+
+    void initialise (const te::PluginInitialisationInfo& info) override {
+        sampleRate = info.sampleRate;
+
+        // Room for the dry signal of the crossfades, sized here so the audio thread never allocates.
+        dry.setSize (2, jmax (info.blockSizeSamples, 8192), false, false, true);
+
+        for (auto* s : slots) {
+            s->plugin->baseClassInitialise (info);
+            s->initialised = true;
+            s->blocksSinceStart = 0;
+            s->gain = s->bypassed ? 0.0f : 1.0f;
+        }
+    }
+
+    void deinitialise() override {
+        for (auto* s : slots) {
+            if (s->initialised)
+                s->plugin->baseClassDeinitialise();
+
+            s->initialised = false;
+        }
+    }
+
+    void applyToBuffer (const te::PluginRenderContext& fc) override {
+        APOLLON_TRACE_ZONE ("effects chain");
+
+        if (! fc.isRendering)
+            ThreadPolicy::applyToAudioThread();
+
+        RealtimeGuard::ScopedAudioThread audioThread (! fc.isRendering);
+
+        const SpinLock::ScopedTryLockType sl (chainLock);
+
+        if (! sl.isLocked() || fc.destBuffer == nullptr || fc.bufferNumSamples == 0)
+            return;
+
+        const double blockMicros = fc.bufferNumSamples / sampleRate * 1.0e6;
+        const bool canCrossfade = fc.bufferNumSamples <= dry.getNumSamples();
+        const int numChannels = jmin (fc.destBuffer->getNumChannels(), dry.getNumChannels());
+
+        for (auto* s : slots) {
+            const float target = s->bypassed.load (std::memory_order_relaxed) ? 0.0f : 1.0f;
+
+            // Fully faded out, so it costs nothing at all.
+            if (! s->initialised || (target == 0.0f && s->gain == 0.0f))
+                continue;
+
+            const bool fading = canCrossfade && s->gain != target;
+
+            if (fading)
+                for (int ch = 0; ch < numChannels; ++ch)
+                    dry.copyFrom (ch, 0, *fc.destBuffer, ch, fc.bufferStartSample, fc.bufferNumSamples);
+
+            const auto start = Time::getHighResolutionTicks();
+            s->plugin->applyToBufferWithAutomation (fc);
+            const auto micros = (float) (Time::highResolutionTicksToSeconds (Time::getHighResolutionTicks() - start) * 1.0e6);
+
+            if (fading) {
+                for (int ch = 0; ch < numChannels; ++ch) {
+                    fc.destBuffer->applyGainRamp (ch, fc.bufferStartSample, fc.bufferNumSamples, s->gain, target);
+                    fc.destBuffer->addFromWithRamp (ch, fc.bufferStartSample, dry.getReadPointer (ch), fc.bufferNumSamples,
+                                                    1.0f - s->gain, 1.0f - target);
+                }
+            }
+
+            s->gain = target;
+            account (*s, micros, blockMicros);
+        }
+    }
+
+private:
+    //==============================================================================
+    struct Slot {
+        Slot (te::Plugin::Ptr p) : plugin (p) {}
+
+        te::Plugin::Ptr plugin;
+        bool initialised = false;
+        float gain = 1.0f;
+        int blocksSinceStart = 0;
+
+        std::atomic<float> microsPerBlock { 0.0f }, load { 0.0f };
+        std::atomic<bool> bypassed { false }, autoBypassed { false };
+    };
+
+    //==============================================================================
+    // Keeps the slots in step with the effects in the chain's state.
+    struct StateListener  : public ValueTree::Listener {
+        StateListener (EffectsChainPlugin& o) : owner (o)           { owner.state.addListener (this); }
+        ~StateListener() override                                   { owner.state.removeListener (this); }
+
+        void valueTreeChildAdded (ValueTree& parent, ValueTree&) override          { if (parent == owner.state) owner.syncSlotsToState(); }
+        void valueTreeChildRemoved (ValueTree& parent, ValueTree&, int) override   { if (parent == owner.state) owner.syncSlotsToState(); }
+        void valueTreeChildOrderChanged (ValueTree& parent, int, int) override     { if (parent == owner.state) owner.syncSlotsToState(); }
+
+        EffectsChainPlugin& owner;
+    };
+
+    OwnedArray<Slot> slots;
+    SpinLock chainLock;
+    std::unique_ptr<StateListener> stateListener;
+    AudioBuffer<float> dry;
+    double sampleRate = 44100.0;
+
+    // Rebuilds the slots from the effects in the state, keeping the slot, and its timings, of any effect that is still there.
+    void syncSlotsToState() {
+        Array<te::Plugin::Ptr> plugins;
+
+        for (auto child : state)
+            if (child.hasType (te::IDs::PLUGIN))
+                if (auto p = edit.getPluginCache().getOrCreatePluginFor (child))
+                    plugins.add (p);
+
+        OwnedArray<Slot> synced;
+
+        {
+            const SpinLock::ScopedLockType sl (chainLock);
+
+            for (auto& p : plugins) {
+                Slot* slot = nullptr;
+
+                for (int i = 0; i < slots.size() && slot == nullptr; ++i)
+                    if (slots.getUnchecked (i)->plugin == p)
+                        slot = slots.removeAndReturn (i);
+
+                synced.add (slot != nullptr ? slot : new Slot (p));
+            }
+
+            slots.swapWith (synced);
+        }
+
+        // What's left over was removed from the state.
+        for (auto* s : synced)
+            if (s->initialised)
+                s->plugin->baseClassDeinitialise();
+
+        // Rebuilding playback initialises any new effect and picks up the latency it adds or takes away.
+        edit.restartPlayback();
+    }
+
+    // The first blocks after initialising include one-off set-up work, so they aren't held against an effect.
+    static constexpr int warmUpBlocks = 16;
+
+    // Updates an effect's smoothed cost, and bypasses it if it is over budget.
+    void account (Slot& s, float micros, double blockMicros) noexcept {
+        const float smoothed = s.microsPerBlock.load (std::memory_order_relaxed);
+        s.microsPerBlock.store (smoothed + 0.125f * (micros - smoothed), std::memory_order_relaxed);
+        s.load.store ((float) (s.microsPerBlock.load (std::memory_order_relaxed) / blockMicros), std::memory_order_relaxed);
+
+        if (++s.blocksSinceStart < warmUpBlocks)
+            return;
+
+        if (! s.bypassed.load (std::memory_order_relaxed) && s.load.load (std::memory_order_relaxed) > cpuBudget.get()) {
+            s.bypassed.store (true, std::memory_order_relaxed);
+            s.autoBypassed.store (true, std::memory_order_relaxed);
+        }
+    }
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (EffectsChainPlugin)
+};
+//==============================================================================
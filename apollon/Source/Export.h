@@ -0,0 +1,237 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "Utilities.h"
+#include "ApollonPitchShiftPlugin.h"
+#include "EffectsChain.h"
+#include "Metering.h"
+#include "ParallelRender.h"
+#include "SeekCache.h"
+
+namespace te = tracktion_engine;
+
+//==============================================================================
+/**
+    Renders a clip through track 0's plugins (and so the current pitch shift) to a WAV or FLAC file.
+    The render graph is built on the message thread, then driven faster than realtime on a
+    background thread so the UI stays responsive and the render can be cancelled at any point.
+    Long clips skip the graph and go through ParallelPitchRenderer, which spreads one file across every core,
+    as long as the pitch shifter is the only thing on the way that changes the sound (see isOnlyPitchShifted()).
+
+    The graph renders a copy of the clip's edit, so the plugins it drives, and the automation they
+    follow, are never the ones live playback and the UI are using. The job still keeps its clip
+    alive, and destroying the job waits for the render to stop.
+*/
+//==============================================================================
+class ExportJob  : private Thread {
+public:
+
+    // Called on the message thread when the render ends. The string holds an error message, or is empty on success.
+    using FinishedCallback = std::function<void (bool succeeded, bool cancelled, const String& error)>;
+
+    ExportJob (te::Clip& clipToRender, const File& destination, FinishedCallback callback)
+        : Thread ("apollon export"), engine (clipToRender.edit.engine), clip (&clipToRender),
+          destFile (destination), onFinished (std::move (callback)) {
+    }
+
+    ~ExportJob() override {
+        cancel();
+        stopThread (10000);
+    }
+
+    // Returns true if the file extension is one of the export formats.
+    static bool isSupportedFile (const File& f) {
+        return f.hasFileExtension ("wav;flac");
+    }
+
+    // Returns the render parameters for the clip's time range through its track's plugins, at the clip's own sample rate.
+    static te::Renderer::Parameters makeParameters (te::Clip& clip, const File& destination) {
+        auto& formats = clip.edit.engine.getAudioFileFormatManager();
+
+        te::Renderer::Parameters params (clip.edit);
+        params.destFile = destination;
+        params.audioFormat = destination.hasFileExtension ("flac") ? formats.getFlacFormat() : formats.getWavFormat();
+        params.bitDepth = 24;
+        params.time = clip.getEditTimeRange();
+        params.tracksToDo = te::toBitSet (Array<te::Track*> { clip.getTrack() });
+        params.usePlugins = true;
+        params.useMasterPlugins = false;
+        params.realTimeRender = false;
+
+        if (auto wave = dynamic_cast<te::WaveAudioClip*> (&clip))
+            params.sampleRateForAudio = wave->getAudioFile().getSampleRate();
+
+        return params;
+    }
+
+    // Renders the clip on the calling thread, returning an error message or an empty string on success.
+    static String renderNow (te::Clip& clip, const File& destination) {
+        std::atomic<float> progress { 0.0f };
+        destination.deleteFile();
+
+        te::Renderer::RenderTask task (TRANS("Rendering"), makeParameters (clip, destination), &progress, nullptr);
+
+        while (task.runJob() == ThreadPoolJob::jobNeedsRunningAgain) {}
+
+        if (task.errorMessage.isNotEmpty())
+            return task.errorMessage;
+
+        return destination.existsAsFile() ? String() : TRANS("Nothing was rendered");
+    }
+
+    // Renders a file through the same chain MainComponent builds, in a throwaway edit, on the calling thread.
+    // Returns an error message or an empty string on success. If renderSeconds is given it receives the time
+    // spent rendering, not counting building the edit.
+    static String renderFile (te::Engine& engine, const File& input, float semitones, const File& destination,
+                              double* renderSeconds = nullptr) {
+        te::Edit edit (engine, te::createEmptyEdit (engine), te::Edit::forRendering, nullptr, 0);
+        auto track = Helpers::getOrInsertAudioTrackAt (edit, 0);
+        auto plugin = ApollonPitchShiftPlugin::getOrInsert (*track);
+
+        auto clip = Helpers::loadAudioFileAsClip (edit, input);
+
+        if (clip == nullptr || plugin == nullptr)
+            return TRANS("Couldn't build the pitch chain for") + " " + input.getFileName();
+
+        Helpers::preparePitchShiftClip (*clip);
+        plugin->getAutomatableParameterByID ("semitones up")->setParameter (semitones, dontSendNotification);
+
+        const auto start = Time::getMillisecondCounterHiRes();
+        const auto error = renderNow (*clip, destination);
+
+        if (renderSeconds != nullptr)
+            *renderSeconds = (Time::getMillisecondCounterHiRes() - start) / 1000.0;
+
+        edit.getTempDirectory (false).deleteRecursively();
+
+        return error;
+    }
+
+    // Clips at least this long are rendered in parallel segments rather than through the graph.
+    static constexpr double parallelRenderThresholdSeconds = 10.0 * 60.0;
+
+    // Returns true if rendering the clip's file through the pitch shifter alone sounds the same as rendering
+    // it through the track: unity clip gain with no fades, the track's volume at 0 dB and centred, the
+    // effects chain empty or switched off, and nothing else on the track but meters or disabled plugins.
+    static bool isOnlyPitchShifted (te::WaveAudioClip& wave, te::AudioTrack& track) {
+        if (std::abs (wave.getGainDB()) > 0.001f || std::abs (wave.getPan()) > 0.001f
+             || wave.getFadeIn() > 0.0 || wave.getFadeOut() > 0.0)
+            return false;
+
+        for (auto p : track.pluginList.getPlugins()) {
+            if (! p->isEnabled() || dynamic_cast<ApollonPitchShiftPlugin*> (p) != nullptr
+                 || dynamic_cast<OutputMeterPlugin*> (p) != nullptr || dynamic_cast<te::LevelMeterPlugin*> (p) != nullptr)
+                continue;
+
+            if (auto chain = dynamic_cast<EffectsChainPlugin*> (p)) {
+                if (! chain->isTransparent())
+                    return false;
+            }
+            else if (auto volume = dynamic_cast<te::VolumeAndPanPlugin*> (p)) {
+                if (std::abs (volume->getVolumeDb()) > 0.001f || std::abs (volume->getPan()) > 0.001f)
+                    return false;
+            }
+            else {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Builds the render graph and starts rendering. Must be called on the message thread.
+    bool start() {
+        destFile.deleteFile();
+
+        auto wave = dynamic_cast<te::WaveAudioClip*> (clip.get());
+        auto track = dynamic_cast<te::AudioTrack*> (clip->getTrack());
+        auto plugin = track != nullptr ? track->pluginList.findFirstPluginOfType<ApollonPitchShiftPlugin>() : nullptr;
+
+        // Parallel segments only know one transposition and nothing of the rest of the track, so automated
+        // clips, and clips with anything else shaping their sound, go through the graph whatever their length.
+        if (wave != nullptr && plugin != nullptr && plugin->automation.isEmpty() && isOnlyPitchShifted (*wave, *track)
+             && clip->getEditTimeRange().getLength() >= parallelRenderThresholdSeconds) {
+            sourceFile = SeekCache::getSourceFile (*wave);
+            parallelSettings = ParallelPitchRenderer::Settings::fromPlugin (*plugin);
+        }
+        else {
+            clip->edit.flushState();
+            renderEdit = std::make_unique<te::Edit> (engine, clip->edit.state.createCopy(), te::Edit::forRendering, nullptr, 0);
+            auto renderClip = te::findClipForID (*renderEdit, clip->itemID);
+
+            // Playback may be reading a copy converted to the device's rate, the export is made from the file itself.
+            if (auto renderWave = dynamic_cast<te::WaveAudioClip*> (renderClip))
+                SeekCache::playFromSource (*renderWave);
+
+            if (renderClip == nullptr) {
+                MessageManager::callAsync ([callback = onFinished] {
+                    if (callback != nullptr)
+                        callback (false, false, TRANS("Couldn't copy the edit to render it"));
+                });
+
+                return false;
+            }
+
+            task = std::make_unique<te::Renderer::RenderTask> (TRANS("Exporting"), makeParameters (*renderClip, destFile), &progress, nullptr);
+        }
+
+        startThread();
+        return true;
+    }
+
+    // Asks the render to stop as soon as possible, the partial file is deleted. Doesn't wait, destroy the job for that.
+    void cancel() {
+        signalThreadShouldExit();
+    }
+
+    // Returns the progress of the render from 0 to 1.
+    float getProgress() const {
+        return progress.load();
+    }
+
+private:
+    te::Engine& engine;
+    te::Clip::Ptr clip;
+    const File destFile;
+    FinishedCallback onFinished;
+
+    std::unique_ptr<te::Edit> renderEdit;
+    std::unique_ptr<te::Renderer::RenderTask> task;
+    File sourceFile;
+    ParallelPitchRenderer::Settings parallelSettings;
+    std::atomic<float> progress { 0.0f };
+
+    void run() override {
+        ThreadPolicy::applyToBackgroundThread();
+        String renderError;
+
+        if (task == nullptr) {
+            renderError = ParallelPitchRenderer (engine, parallelSettings)
+                              .render (sourceFile, destFile, &progress, [this] { return threadShouldExit(); });
+        }
+        else {
+            while (! threadShouldExit())
+                if (task->runJob() == ThreadPoolJob::jobHasFinished)
+                    break;
+
+            renderError = task->errorMessage;
+        }
+
+        const bool cancelled = threadShouldExit();
+        const String error = cancelled ? String() : renderError;
+        const bool succeeded = ! cancelled && error.isEmpty() && destFile.existsAsFile();
+
+        task.reset();
+
+        if (cancelled)
+            destFile.deleteFile();
+
+        MessageManager::callAsync ([callback = onFinished, succeeded, cancelled, error] {
+            if (callback != nullptr)
+                callback (succeeded, cancelled, error);
+        });
+    }
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (ExportJob)
+};
+//==============================================================================
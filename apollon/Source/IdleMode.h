@@ -0,0 +1,174 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "AppSettings.h"
+
+namespace te = tracktion_engine;
+
+//==============================================================================
+/**
+    Releases the audio device once the transport has been paused for a while, so an idle app
+    stops waking the CPU for every audio block, and reopens it before playback resumes.
+
+    MIDI reaches the pitch shifter through the audio graph, which stops with the device. So while
+    the device is released, every MIDI input is also opened through the device manager, and the
+    first message on any of them reopens the device. That message itself is lost, the next one is
+    heard. If an input can't be opened a second time, as some platforms only allow one client per
+    input, the device is kept open rather than leaving a controller unable to wake it. Audio inputs
+    monitored in live-input mode keep the device open too.
+    The delay is stored in the app settings, 0 keeps the device open for good.
+    Everything here runs on the message thread apart from the MIDI callback.
+*/
+//==============================================================================
+class DeviceSuspender  : private Timer,
+                         private ChangeListener,
+                         private MidiInputCallback,
+                         private AsyncUpdater {
+public:
+
+    DeviceSuspender (te::Edit& e)
+        : edit (e) {
+        edit.getTransport().addChangeListener (this);
+        transportChanged();
+    }
+
+    ~DeviceSuspender() override {
+        edit.getTransport().removeChangeListener (this);
+        wake();
+        cancelPendingUpdate();
+    }
+
+    static constexpr int defaultDelaySeconds = 30;
+
+    // Returns how long the transport has to stay paused before the device is released.
+    static int getDelaySeconds (const AppSettings& settings) {
+        const auto value = settings.get ("idleDeviceSuspendSeconds");
+        return value.isVoid() ? defaultDelaySeconds : jmax (0, (int) value);
+    }
+
+    // Sets the delay for this and future launches, 0 disables suspending.
+    static void setDelaySeconds (AppSettings settings, int seconds) {
+        settings.set ("idleDeviceSuspendSeconds", jmax (0, seconds));
+    }
+
+    // Reopens the device if it was released. Call it just before starting playback so the
+    // device is running by the time the transport asks for audio.
+    void wake() {
+        stopTimer();
+
+        if (! suspended)
+            return;
+
+        suspended = false;
+        stopListeningForMidi();
+        getDeviceManager().restartLastAudioDevice();
+    }
+
+    bool isSuspended() const noexcept     { return suspended; }
+
+private:
+    te::Edit& edit;
+    bool suspended = false;
+    StringArray midiInputsOpened;  // Identifiers of the MIDI inputs opened just to listen for a wake-up.
+
+    AudioDeviceManager& getDeviceManager() {
+        return edit.engine.getDeviceManager().deviceManager;
+    }
+
+    // Returns true if audio input is being monitored, which needs the device whether or not the transport is playing.
+    // MIDI inputs don't count, they're all enabled for the pitch shifter whether or not anything is plugged in.
+    bool hasLiveInput() {
+        auto& dm = edit.engine.getDeviceManager();
+
+        for (int i = 0; i < dm.getNumWaveInDevices(); ++i)
+            if (auto dev = dm.getWaveInDevice (i))
+                if (dev->isEnabled() && dev->isEndToEndEnabled())
+                    return true;
+
+        return false;
+    }
+
+    // Starts the countdown when playback stops, and cancels it (reopening if needed) when it starts.
+    void transportChanged() {
+        auto& transport = edit.getTransport();
+
+        if (transport.isPlaying() || transport.isRecording()) {
+            wake();
+            return;
+        }
+
+        const int delay = getDelaySeconds (edit.engine);
+
+        if (! suspended && delay > 0 && ! isTimerRunning())
+            startTimer (delay * 1000);
+    }
+
+    void changeListenerCallback (ChangeBroadcaster*) override {
+        transportChanged();
+    }
+
+    void timerCallback() override {
+        stopTimer();
+
+        auto& transport = edit.getTransport();
+
+        if (transport.isPlaying() || transport.isRecording() || getDeviceManager().getCurrentAudioDevice() == nullptr
+             || hasLiveInput() || ! startListeningForMidi())
+            return;
+
+        // closeAudioDevice() keeps the setup, so restartLastAudioDevice() brings back exactly the same device.
+        getDeviceManager().closeAudioDevice();
+        suspended = true;
+        Logger::writeToLog ("Audio device released after " + String (getDelaySeconds (edit.engine)) + " s paused");
+    }
+
+    // Opens every MIDI input that isn't open through the device manager already. Returns false, having
+    // closed them again, if one of them couldn't be opened.
+    bool startListeningForMidi() {
+        auto& dm = getDeviceManager();
+
+        for (auto& input : MidiInput::getAvailableDevices()) {
+            if (dm.isMidiInputDeviceEnabled (input.identifier))
+                continue;
+
+            dm.setMidiInputDeviceEnabled (input.identifier, true);
+
+            if (! dm.isMidiInputDeviceEnabled (input.identifier)) {
+                Logger::writeToLog ("Audio device kept open, " + input.name + " can't be watched for MIDI while it's released");
+                stopListeningForMidi();
+                return false;
+            }
+
+            midiInputsOpened.add (input.identifier);
+        }
+
+        dm.addMidiInputDeviceCallback ({}, this);
+        return true;
+    }
+
+    void stopListeningForMidi() {
+        auto& dm = getDeviceManager();
+        dm.removeMidiInputDeviceCallback ({}, this);
+
+        for (auto& identifier : midiInputsOpened)
+            dm.setMidiInputDeviceEnabled (identifier, false);
+
+        midiInputsOpened.clear();
+    }
+
+    // Called on a MIDI thread.
+    void handleIncomingMidiMessage (MidiInput*, const MidiMessage&) override {
+        triggerAsyncUpdate();
+    }
+
+    // Reopens the device, and starts counting down again in case the message didn't start playback.
+    void handleAsyncUpdate() override {
+        if (! suspended)
+            return;
+
+        Logger::writeToLog ("Audio device reopened for MIDI input");
+        wake();
+        transportChanged();
+    }
+};
+//==============================================================================
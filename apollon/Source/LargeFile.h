@@ -0,0 +1,245 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "ThreadPolicy.h"
+#include "SeekCache.h"
+
+namespace te = tracktion_engine;
+
+//==============================================================================
+/**
+    Waveform overview built from the file directly, in a fixed amount of memory whatever its length.
+
+    Files that seek cheaply (WAV/AIFF and friends, or a compressed file whose SeekCache copy is
+    ready) are split into contiguous chunks, one per core, each decoded by its own reader on a
+    thread pool. Those readers jump straight to a chunk's byte range, so no chunk waits for
+    another, and the time to a complete waveform shrinks with the number of cores. Anything else is
+    scanned front to back by one reader, since every MP3 or FLAC reader would have to open and
+    seek through the file on its own. Every chunk folds its samples into its own range of a fixed
+    number of min/max buckets and publishes them in order with a counter of its own.
+
+    All positions are 64-bit, so files well beyond 4 GB (RF64/BWF) work.
+*/
+//==============================================================================
+class StreamingPeaks {
+public:
+
+    static constexpr int numBuckets = 4096;
+    static constexpr int maxChannels = 2;
+    static constexpr int maxChunks = 64;
+    static constexpr int chunkSize = 1 << 16;
+
+    StreamingPeaks (te::Engine& e)
+        : engine (e) {
+    }
+
+    ~StreamingPeaks() {
+        clear();
+    }
+
+    // Starts scanning a file, dropping whatever was shown before.
+    void setFile (const File& f) {
+        clear();
+        file = f;
+        jobsRunning = 1;
+        pool.addJob (new PlanJob (*this), true);
+    }
+
+    void clear() {
+        // A plan job that was running may have queued its chunks before it saw the request to stop.
+        while (pool.getNumJobs() > 0)
+            pool.removeAllJobs (true, 2000);
+
+        file = File();
+        numChannels = 0;
+        numChunks = 0;
+        bucketsDone = 0;
+        jobsRunning = 0;
+    }
+
+    // Returns true while buckets are still being filled.
+    bool isScanning() const     { return jobsRunning.load() > 0; }
+
+    // Returns the fraction of the file that has been scanned.
+    float getProgress() const   { return bucketsDone.load() / (float) numBuckets; }
+
+    // Draws the buckets scanned so far across the area, one lane per channel. The rest stays empty.
+    void draw (Graphics& g, Rectangle<int> area) const {
+        const int chunks = numChunks.load (std::memory_order_acquire);
+        const int channels = numChannels.load();
+
+        if (chunks == 0 || channels == 0 || area.isEmpty())
+            return;
+
+        // Each chunk's published count, read once so the whole frame agrees on what is finished.
+        int done[maxChunks];
+
+        for (int c = 0; c < chunks; ++c)
+            done[c] = chunkDone[c].load (std::memory_order_acquire);
+
+        const float laneHeight = area.getHeight() / (float) channels;
+
+        for (int ch = 0; ch < channels; ++ch) {
+            const float centre = area.getY() + laneHeight * (ch + 0.5f);
+
+            for (int x = 0; x < area.getWidth(); ++x) {
+                const int first = x * numBuckets / area.getWidth();
+                const int last = jmax (first + 1, (x + 1) * numBuckets / area.getWidth());
+
+                float low = 0.0f, high = 0.0f;
+                bool any = false;
+
+                for (int b = first; b < last; ++b) {
+                    const int c = getChunkOf (b, chunks);
+
+                    if (b >= getChunkStart (c, chunks) + done[c])
+                        continue;
+
+                    low = any ? jmin (low, mins[ch][b]) : mins[ch][b];
+                    high = any ? jmax (high, maxes[ch][b]) : maxes[ch][b];
+                    any = true;
+                }
+
+                if (any)
+                    g.drawVerticalLine (area.getX() + x, centre - high * laneHeight * 0.5f, centre - low * laneHeight * 0.5f + 1.0f);
+            }
+        }
+    }
+
+private:
+    te::Engine& engine;
+    File file;
+    ThreadPool pool { jlimit (1, maxChunks, SystemStats::getNumCpus()) };
+
+    float mins[maxChannels][numBuckets] {}, maxes[maxChannels][numBuckets] {};
+    std::atomic<int> numChannels { 0 }, numChunks { 0 }, bucketsDone { 0 }, jobsRunning { 0 };
+    std::atomic<int> chunkDone[maxChunks] {};
+    int64 length = 0;
+
+    // Returns the first sample that falls into the given bucket.
+    static int64 getBucketStart (int bucket, int64 fileLength) noexcept {
+        return (int64) bucket * fileLength / numBuckets;
+    }
+
+    // Returns the first bucket of a chunk, and the chunk a bucket belongs to.
+    static int getChunkStart (int chunk, int chunks) noexcept     { return chunk * numBuckets / chunks; }
+    static int getChunkOf (int bucket, int chunks) noexcept       { return ((bucket + 1) * chunks - 1) / numBuckets; }
+
+    std::unique_ptr<AudioFormatReader> createReader() {
+        // Chunks seek far into the file, which a compressed source only does cheaply through its copy.
+        return std::unique_ptr<AudioFormatReader> (engine.getAudioFileFormatManager().readFormatManager.createReaderFor (SeekCache::resolve (engine, file)));
+    }
+
+    //==============================================================================
+    // Reads the header, which for some formats means walking the file, then splits the scan into chunk jobs.
+    struct PlanJob  : public ThreadPoolJob {
+        PlanJob (StreamingPeaks& o) : ThreadPoolJob ("peaks plan"), owner (o) {}
+
+        JobStatus runJob() override {
+            ThreadPolicy::applyToBackgroundThread();
+            auto reader = owner.createReader();
+
+            if (reader != nullptr && reader->lengthInSamples > 0 && ! shouldExit()) {
+                const int channels = jmin (maxChannels, (int) reader->numChannels);
+
+                for (int ch = 0; ch < channels; ++ch) {
+                    std::fill (std::begin (owner.mins[ch]), std::end (owner.mins[ch]), 0.0f);
+                    std::fill (std::begin (owner.maxes[ch]), std::end (owner.maxes[ch]), 0.0f);
+                }
+
+                // Short files aren't worth splitting below a few reads per chunk, and compressed ones aren't worth seeking into.
+                const int64 minChunkLength = 4 * (int64) chunkSize;
+                const int chunks = SeekCache::needsCopy (SeekCache::resolve (owner.engine, owner.file))
+                                     ? 1 : (int) jlimit ((int64) 1, (int64) owner.pool.getNumThreads(), reader->lengthInSamples / minChunkLength);
+
+                for (int c = 0; c < chunks; ++c)
+                    owner.chunkDone[c] = 0;
+
+                owner.length = reader->lengthInSamples;
+                owner.numChannels = channels;
+                owner.numChunks.store (chunks, std::memory_order_release);
+                owner.jobsRunning += chunks;
+
+                // This reader has already done the header work, so the first chunk keeps it.
+                owner.pool.addJob (new ChunkJob (owner, 0, std::move (reader)), true);
+
+                for (int c = 1; c < chunks; ++c)
+                    owner.pool.addJob (new ChunkJob (owner, c, nullptr), true);
+            }
+
+            --owner.jobsRunning;
+            return jobHasFinished;
+        }
+
+        StreamingPeaks& owner;
+    };
+
+    //==============================================================================
+    // Decodes one chunk and folds it into that chunk's buckets, in order.
+    struct ChunkJob  : public ThreadPoolJob {
+        ChunkJob (StreamingPeaks& o, int chunkIndex, std::unique_ptr<AudioFormatReader> r)
+            : ThreadPoolJob ("peaks chunk"), owner (o), chunk (chunkIndex), reader (std::move (r)) {}
+
+        JobStatus runJob() override {
+            ThreadPolicy::applyToBackgroundThread();
+
+            if (reader == nullptr)
+                reader = owner.createReader();
+
+            if (reader != nullptr)
+                scan();
+
+            --owner.jobsRunning;
+            return jobHasFinished;
+        }
+
+        StreamingPeaks& owner;
+        const int chunk;
+        std::unique_ptr<AudioFormatReader> reader;
+
+        void scan() {
+            const int chunks = owner.numChunks.load();
+            const int64 length = owner.length;
+            const int channels = owner.numChannels.load();
+            const int lastBucket = getChunkStart (chunk + 1, chunks);
+            const int64 end = getBucketStart (lastBucket, length);
+            int bucket = getChunkStart (chunk, chunks);
+
+            // The only buffer, however long the file is.
+            AudioBuffer<float> block ((int) reader->numChannels, chunkSize);
+
+            for (int64 pos = getBucketStart (bucket, length); pos < end && ! shouldExit(); pos += chunkSize) {
+                const int n = (int) jmin ((int64) chunkSize, end - pos);
+                reader->read (&block, 0, n, pos, true, true);
+
+                for (int i = 0; i < n;) {
+                    const int64 bucketEnd = getBucketStart (bucket + 1, length);
+                    const int stop = (int) jmin ((int64) n, bucketEnd - pos);
+
+                    if (stop > i) {
+                        for (int ch = 0; ch < channels; ++ch) {
+                            const auto range = FloatVectorOperations::findMinAndMax (block.getReadPointer (ch, i), stop - i);
+                            owner.mins[ch][bucket] = jmin (owner.mins[ch][bucket], range.getStart());
+                            owner.maxes[ch][bucket] = jmax (owner.maxes[ch][bucket], range.getEnd());
+                        }
+                    }
+
+                    i = jmax (i, stop);
+
+                    // This bucket is complete, publish it and every empty one before the next sample.
+                    while (bucket < lastBucket && getBucketStart (bucket + 1, length) <= pos + i) {
+                        ++bucket;
+                        owner.chunkDone[chunk].fetch_add (1, std::memory_order_release);
+                        ++owner.bucketsDone;
+                    }
+
+                    if (bucket >= lastBucket)
+                        break;
+                }
+            }
+        }
+    };
+
+    JUCE_DECLARE_NON_COPYABLE (StreamingPeaks)
+};
+//==============================================================================
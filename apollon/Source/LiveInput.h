@@ -0,0 +1,115 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+namespace te = tracktion_engine;
+
+//==============================================================================
+/**
+    Pitch shifter for live input, with a delay of a few milliseconds.
+
+    The te::TimeStretcher back ends work on FFT frames and buffer tens of milliseconds before they
+    output anything, and none of them expose their window size. This one is a time-domain delay line
+    read by two taps half a window apart. The taps move through the window at the rate the
+    transposition needs, and each fades to silence as it wraps. The added delay averages half a
+    window, about 5 ms, and doesn't depend on the device's block size. Held notes warble a
+    little more than with the FFT back ends, which is the usual trade for live use.
+
+    prepare() is called on the message thread while the graph is stopped, process() on the audio
+    thread, which never allocates.
+*/
+//==============================================================================
+class DelayLineShifter {
+public:
+
+    static constexpr double windowSeconds = 0.010;
+
+    void prepare (double newSampleRate, int numChannels) {
+        sampleRate = newSampleRate;
+        window = jmax (32, roundToInt (windowSeconds * sampleRate));
+
+        const int size = nextPowerOfTwo (window + 4);
+        buffer.setSize (numChannels, size);
+        buffer.clear();
+        mask = size - 1;
+        writePos = 0;
+        phase = 0.0;
+    }
+
+    // The average delay through the two taps.
+    double getLatencySeconds() const noexcept {
+        return (1.0 + window * 0.5) / sampleRate;
+    }
+
+    void process (AudioBuffer<float>& block, int startSample, int numSamples, float semitones) noexcept {
+        const int channels = jmin (block.getNumChannels(), buffer.getNumChannels());
+
+        if (channels == 0)
+            return;
+
+        // Moving the taps towards the input raises the pitch, moving them away lowers it.
+        double step = (1.0 - std::pow (2.0, semitones / 12.0)) / window;
+
+        // Untransposed, drift to where the fading tap is silent, so what's left is a clean delay
+        // rather than two delays comb-filtering each other. The glide is a few cents at most.
+        if (semitones == 0.0f && phase != 0.0)
+            step = -jmin (phase, 0.002 / window);
+
+        for (int i = 0; i < numSamples; ++i) {
+            const double other = phase < 0.5 ? phase + 0.5 : phase - 0.5;
+            const double d1 = 1.0 + phase * window, d2 = 1.0 + other * window;
+
+            // Raised-cosine gains that sum to one, zero for each tap at the moment it wraps.
+            const auto g1 = (float) std::pow (std::sin (MathConstants<double>::pi * phase), 2.0);
+            const float g2 = 1.0f - g1;
+
+            for (int ch = 0; ch < channels; ++ch) {
+                auto* line = buffer.getWritePointer (ch);
+                auto* io = block.getWritePointer (ch, startSample);
+
+                line[writePos] = io[i];
+                io[i] = g1 * read (line, d1) + g2 * read (line, d2);
+            }
+
+            writePos = (writePos + 1) & mask;
+            phase += step;
+
+            if (phase >= 1.0)       phase -= 1.0;
+            else if (phase < 0.0)   phase += 1.0;
+        }
+    }
+
+private:
+    AudioBuffer<float> buffer;
+    double sampleRate = 44100.0, phase = 0.0;
+    int window = 441, mask = 0, writePos = 0;
+
+    // Reads the line the given number of samples behind the write position, interpolating linearly.
+    float read (const float* line, double delay) const noexcept {
+        const double pos = writePos - delay;
+        const int index = (int) std::floor (pos);
+        const auto frac = (float) (pos - index);
+
+        const float a = line[index & mask], b = line[(index + 1) & mask];
+        return a + frac * (b - a);
+    }
+};
+
+//==============================================================================
+namespace LiveInput {
+
+    // Returns the time from a sound reaching the input to it leaving the output: the device's
+    // own latencies, one block of input and one of output, plus the given processing delay.
+    inline double getEndToEndLatencySeconds (te::Engine& engine, double processingSeconds) {
+        auto device = engine.getDeviceManager().deviceManager.getCurrentAudioDevice();
+
+        if (device == nullptr || device->getCurrentSampleRate() <= 0.0)
+            return processingSeconds;
+
+        const int samples = device->getInputLatencyInSamples() + device->getOutputLatencyInSamples()
+                              + 2 * device->getCurrentBufferSizeSamples();
+
+        return samples / device->getCurrentSampleRate() + processingSeconds;
+    }
+}
+//==============================================================================
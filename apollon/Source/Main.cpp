@@ -6,8 +6,15 @@
   ==============================================================================
 */
 
+// This is the one translation unit that defines the real-time guard's allocator and lock hooks.
+#define APOLLON_RT_GUARD_IMPLEMENTATION 1
+
 #include <JuceHeader.h>
 #include "MainComponent.h"
+#include "Regression.h"
+#include "SingleInstance.h"
+#include "Batch.h"
+#include "RenderDaemon.h"
 
 //==============================================================================
 class apollonApplication  : public juce::JUCEApplication
@@ -25,14 +32,53 @@ public:
     {
         // This method is where you should put your application's initialisation code..
 
+        // A batch worker only renders what its coordinator sends it, and quits when the coordinator goes away.
+        if ((batchWorker = Batch::Worker::createIfRequested (commandLine)) != nullptr)
+            return;
+
+        StartupTrace::mark ("initialise");
+
+        // Tracing can be switched on from the start, to catch start-up and the first file load.
+        if (juce::SystemStats::getEnvironmentVariable ("APOLLON_TRACE", {}).isNotEmpty())
+            Tracing::Recorder::getInstance().setEnabled (true);
+
+        if (RealtimeGuard::isActive())
+            realtimeGuardReporter = std::make_unique<RealtimeGuard::Reporter>();
+
+        // Headless modes run to completion and quit without ever opening a window.
+        if (runCommandLineMode (commandLine))
+            return;
+
+        const auto files = getFileArguments (commandLine);
+
+        // In single-instance mode, hand the files to the running instance instead of starting a second engine.
+        if (SingleInstance::isEnabled())
+        {
+            if (SingleInstance::forwardToRunningInstance (files))
+            {
+                quit();
+                return;
+            }
+
+            singleInstance = std::make_unique<SingleInstance> ([this] (const juce::StringArray& args) { openFiles (args); });
+            singleInstance->startListening();
+        }
+
         mainWindow.reset (new MainWindow (getApplicationName()));
+        StartupTrace::mark ("window created");
+        openFiles (files);
     }
 
     void shutdown() override
     {
         // Add your application's shutdown code here..
 
+        batchWorker = nullptr;
+        renderDaemon = nullptr;
+        daemonEngine = nullptr;
+        singleInstance = nullptr;
         mainWindow = nullptr; // (deletes our window)
+        realtimeGuardReporter = nullptr;
     }
 
     //==============================================================================
@@ -48,6 +94,7 @@ public:
         // When another instance of the app is launched while this one is running,
         // this method is invoked, and the commandLine parameter tells you what
         // the other instance's command-line arguments were.
+        openFiles (getFileArguments (commandLine));
     }
 
     //==============================================================================
@@ -79,6 +126,13 @@ public:
             setVisible (true);
         }
 
+        // Passes files opened from outside the app on to the content component.
+        void openFiles (const juce::StringArray& paths)
+        {
+            if (auto content = dynamic_cast<MainComponent*> (getContentComponent()))
+                content->openFiles (paths);
+        }
+
         void closeButtonPressed() override
         {
             // This is called when the user tries to close this window. Here, we'll just
@@ -100,6 +154,202 @@ public:
 
 private:
     std::unique_ptr<MainWindow> mainWindow;
+    std::unique_ptr<SingleInstance> singleInstance;
+    std::unique_ptr<Batch::Worker> batchWorker;
+    std::unique_ptr<te::Engine> daemonEngine;
+    std::unique_ptr<RenderDaemon> renderDaemon;
+    std::unique_ptr<RealtimeGuard::Reporter> realtimeGuardReporter;
+
+    // Returns the arguments that aren't switches, i.e. the files the app was asked to open.
+    static juce::StringArray getFileArguments (const juce::String& commandLine)
+    {
+        juce::StringArray args;
+        args.addTokens (commandLine, true);
+        args.trim();
+        args.removeEmptyStrings();
+
+        juce::StringArray files;
+
+        for (auto& a : args)
+            if (! a.startsWith ("-"))
+                files.add (juce::File::getCurrentWorkingDirectory().getChildFile (a.unquoted()).getFullPathName());
+
+        return files;
+    }
+
+    // Loads files into the window, or just brings it to the front if there are none.
+    void openFiles (const juce::StringArray& files)
+    {
+        if (mainWindow == nullptr)
+            return;
+
+        mainWindow->toFront (true);
+
+        if (! files.isEmpty())
+            mainWindow->openFiles (files);
+    }
+
+    // Runs a headless mode if the command line asks for one. Returns false if the GUI should start as normal.
+    bool runCommandLineMode (const juce::String& commandLine)
+    {
+        juce::StringArray args;
+        args.addTokens (commandLine, true);
+        args.trim();
+        args.removeEmptyStrings();
+
+        if (args[0] == "--regression")
+        {
+            te::Engine engine { getApplicationName() };
+            engine.getPluginManager().createBuiltInType<ApollonPitchShiftPlugin>();
+
+            // The renders run the same processing code as playback, so the real-time guard watches them too.
+            RealtimeGuard::guardRenders = true;
+
+            const auto folder = juce::File::getCurrentWorkingDirectory().getChildFile (args[1].unquoted());
+            RegressionRunner runner (engine, folder, args.contains ("--update"));
+            auto failures = runner.run() + runner.runBatchCase();
+
+            if (args.contains ("--long"))
+                failures += runner.runLongInputCase();
+
+            // With the real-time guard compiled in, any allocation, lock or sleep inside the renders' processing also fails the run.
+            const auto violations = RealtimeGuard::Reporter::getNumViolations();
+
+            if (! RealtimeGuard::isActive())
+                std::cout << "Real-time check skipped, build with APOLLON_RT_GUARD=1 to run it" << std::endl;
+            else if (violations > 0)
+                std::cout << violations << " real-time violation(s) in the pitch chain, see the log for their stacks" << std::endl;
+
+            setApplicationReturnValue (failures == 0 && violations == 0 ? 0 : 1);
+            quit();
+            return true;
+        }
+
+        if (args[0] == "--single-instance")
+        {
+            // apollon --single-instance on|off
+            SingleInstance::setEnabled (args[1] == "on");
+            std::cout << "Single-instance mode " << (SingleInstance::isEnabled() ? "on" : "off") << std::endl;
+
+            quit();
+            return true;
+        }
+
+        if (args[0] == "--batch")
+        {
+            // apollon --batch <folder or list file> <output folder> [--semitones n] [--workers n]
+            te::Engine engine { getApplicationName() };
+            const auto cwd = juce::File::getCurrentWorkingDirectory();
+            const auto inputs = Batch::Coordinator::findInputs (cwd.getChildFile (args[1].unquoted()), engine);
+
+            const int numWorkers = args.contains ("--workers") ? args[args.indexOf ("--workers") + 1].getIntValue()
+                                                               : juce::jmax (1, juce::SystemStats::getNumCpus() / 2);
+
+            const float semitones = args.contains ("--semitones") ? args[args.indexOf ("--semitones") + 1].getFloatValue() : 0.0f;
+
+            Batch::Coordinator coordinator (inputs, cwd.getChildFile (args[2].unquoted()), semitones, numWorkers);
+
+            setApplicationReturnValue (coordinator.run() == 0 ? 0 : 1);
+            quit();
+            return true;
+        }
+
+        if (args[0] == "--daemon")
+        {
+            // apollon --daemon [socket path] [--jobs n], keeps running until it's killed
+            const auto socket = args[1].isNotEmpty() && ! args[1].startsWith ("-")
+                                  ? juce::File::getCurrentWorkingDirectory().getChildFile (args[1].unquoted())
+                                  : RenderDaemon::getDefaultSocketFile();
+
+            daemonEngine = std::make_unique<te::Engine> (getApplicationName());
+            renderDaemon = std::make_unique<RenderDaemon> (*daemonEngine, socket,
+                                                           args.contains ("--jobs") ? args[args.indexOf ("--jobs") + 1].getIntValue() : 1);
+
+            const auto error = renderDaemon->start();
+
+            if (error.isNotEmpty())
+            {
+                std::cerr << error << std::endl;
+                setApplicationReturnValue (1);
+                quit();
+            }
+
+            return true;
+        }
+
+        if (args[0] == "--idle-suspend")
+        {
+            // apollon --idle-suspend <seconds>, 0 keeps the audio device open while paused
+            AppSettings settings;
+            DeviceSuspender::setDelaySeconds (settings, args[1].getIntValue());
+            std::cout << "Audio device released after " << DeviceSuspender::getDelaySeconds (settings) << " s paused (0 = never)" << std::endl;
+
+            quit();
+            return true;
+        }
+
+        if (args[0] == "--src")
+        {
+            // apollon --src <linear|lagrange|sinc> [--preconvert], the resampling quality and whether files are converted to the device's rate on load
+            AppSettings settings;
+
+            for (auto q : { Resampling::Quality::linear, Resampling::Quality::lagrange, Resampling::Quality::sinc })
+                if (args[1] == Resampling::getName (q))
+                    Resampling::setQuality (settings, q);
+
+            Resampling::setPreconvert (settings, args.contains ("--preconvert"));
+
+            std::cout << "Resampling: " << Resampling::getName (Resampling::getQuality (settings))
+                      << (Resampling::shouldPreconvert (settings) ? ", files pre-converted to the device rate" : "") << std::endl
+                      << (Resampling::shouldPreconvert (settings) ? "" : "Without --preconvert, normal playback resamples inside tracktion and only render-ahead uses this quality.\n");
+
+            quit();
+            return true;
+        }
+
+        if (args[0] == "--thread-policy")
+        {
+            // apollon --thread-policy <cores|any> [--priority n] [--rr], e.g. "--thread-policy 2,3 --priority 70"
+            ThreadPolicy::Settings settings;
+            settings.audioCores = ThreadPolicy::Settings::parseCores (args[1]);
+            settings.priority = args.contains ("--priority") ? juce::jlimit (0, 99, args[args.indexOf ("--priority") + 1].getIntValue()) : 0;
+            settings.roundRobin = args.contains ("--rr");
+            settings.save (AppSettings());
+
+            std::cout << "Next launch: " << settings.describe() << std::endl;
+
+            if (! ThreadPolicy::isSupported())
+                std::cout << "Stored, but this platform can't pin or prioritise threads" << std::endl;
+
+            quit();
+            return true;
+        }
+
+        if (args[0] == "--render")
+        {
+            // apollon --render <input> <output> [--semitones n] [--threads n]
+            te::Engine engine { getApplicationName() };
+
+            ParallelPitchRenderer::Settings settings;
+            if (args.contains ("--semitones"))
+                settings.semitones = args[args.indexOf ("--semitones") + 1].getFloatValue();
+
+            if (args.contains ("--threads"))
+                settings.numThreads = juce::jmax (1, args[args.indexOf ("--threads") + 1].getIntValue());
+
+            const auto cwd = juce::File::getCurrentWorkingDirectory();
+            const auto error = ParallelPitchRenderer (engine, settings).render (cwd.getChildFile (args[1].unquoted()),
+                                                                                cwd.getChildFile (args[2].unquoted()));
+            if (error.isNotEmpty())
+                std::cerr << error << std::endl;
+
+            setApplicationReturnValue (error.isEmpty() ? 0 : 1);
+            quit();
+            return true;
+        }
+
+        return false;
+    }
 };
 
 //==============================================================================
@@ -2,6 +2,14 @@
 
 #include <JuceHeader.h>
 #include "Utilities.h"
+#include "ApollonPitchShiftPlugin.h"
+#include "Metering.h"
+#include "Export.h"
+#include "Session.h"
+#include "StartupTrace.h"
+#include "IdleMode.h"
+#include "EffectsChain.h"
+#include "SeekCache.h"
 
 using namespace tracktion_engine;
 
@@ -27,44 +35,39 @@ public:
         setSize (300, 300);
         setWantsKeyboardFocus(true);
         
-        // Registers this ChangeListener with the audio transport.
-        transport.addChangeListener(this);
-        
         
-        // Adds all elements to the MainComponent and makes them visible.
+        // Adds all elements to the MainComponent and makes them visible, the thumbnail follows once the engine is up.
         Helpers::addAndMakeVisible(*this,
-                                   {&playPauseButton, &loadFileButton, &thumbnail, &pitchShiftSlider});
+                                   {&playPauseButton, &loadFileButton, &exportButton, &effectsButton, &compareButton, &pitchShiftSlider, &outputMeter});
+        addChildComponent(hud);
         
         // Sets behavior of buttons when pressed.
-        playPauseButton.onClick = [this] {if(loaded) Helpers::togglePlay(edit);}; // Plays the file if it was loaded
-        loadFileButton.onClick = [this] {Helpers::browseForAudioFile(engine, [this] (const File& f) {f.exists() ? setFile (f) : noFileChosen(); });}; // Loads the chosen file if it exists
+        playPauseButton.onClick = [this] {if(loaded) {wakeAudioDevice(); Helpers::togglePlay(*edit);}}; // Plays the file if it was loaded
+        loadFileButton.onClick = [this] {Helpers::browseForAudioFile(*engine, [this] (const File& f) {f.exists() ? setFile (f) : noFileChosen(); });}; // Loads the chosen file if it exists
+        exportButton.onClick = [this] {exportJob != nullptr ? exportJob->cancel() : browseForExportFile();}; // Exports the transposed file, or cancels a running export
+        effectsButton.onClick = [this] {showEffectsMenu();}; // Adds, bypasses or removes effects after the pitch shifter
+        compareButton.onClick = [this] {if(pitchShifter != nullptr) pitchShifter->setShowingOriginal(compareButton.getToggleState());}; // Switches between the original and the transposed audio
         
         // Makes sure clicking the buttons doesn't change their state (i.e. changing the button image).
         playPauseButton.setClickingTogglesState(false);
         loadFileButton.setClickingTogglesState(false);
         
-        // Sets the images of the buttons.
+        // Sets the images of the buttons, which stay disabled until the engine is ready.
         updatePlayButtonText();
+        playPauseButton.setEnabled(false);
+        loadFileButton.setEnabled(false);
         loadFileButton.setImages(false, true, false, load_white, 1.0f, {}, load_black, 1.0f, {}, load_white, 1.0f, {});
         
+        // Export stays disabled until there is something to export, and shows the progress while rendering.
+        exportButton.setEnabled(false);
+        effectsButton.setEnabled(false);
+        compareButton.setClickingTogglesState(true);
+        compareButton.setEnabled(false);
+        exportProgressUpdater.setCallback([this] {if(exportJob != nullptr) exportButton.setButtonText(String(roundToInt(exportJob->getProgress() * 100.0f)) + "%");});
+        
 
-        // Setup pitch shifting.
+        // The slider's look is set now, it's bound to the pitch shifter once the engine is up.
         {
-            // Register the PitchShiftPlugin with the engine.
-            engine.getPluginManager().createBuiltInType<PitchShiftPlugin>();
-            
-            // Create new instance of plugin and insert in track 1.
-            auto pitchShiftPlugin = edit.getPluginCache().createNewPlugin(PitchShiftPlugin::xmlTypeName, {});
-            
-            auto track = Helpers::getOrInsertAudioTrackAt(edit, 0);
-            track->pluginList.insertPlugin(pitchShiftPlugin, 0, nullptr);
-            
-            // Connect slider value.
-            auto pitchShiftParam = pitchShiftPlugin->getAutomatableParameterByID ("semitones up");
-            bindSliderToParameter(pitchShiftSlider, *pitchShiftParam);
-            pitchShiftSlider.setSkewFactorFromMidPoint(0.0);
-            
-            
             // Remove text box from the slider.
             pitchShiftSlider.setTextBoxStyle(juce::Slider::TextEntryBoxPosition::NoTextBox, 0, 0, 0);
             
@@ -73,34 +76,92 @@ public:
             pitchShiftSlider.setSliderStyle(juce::Slider::RotaryHorizontalDrag);
             pitchShiftSlider.setRotaryParameters(3*(3.1415/2) + (3.1415/4), 5*(3.1415/2) - (3.1415/4), true);
             pitchShiftSlider.setRange(-4.0, 4.0); // Slider can transpose from -7 to 7 semitones
-            pitchShiftSlider.setValue(0.0);
             pitchShiftSlider.setDoubleClickReturnValue(true, 0.0, {});
-            
+            pitchShiftSlider.setEnabled(false);
         }
         
+        StartupTrace::mark("window content built");
     }
 
     // MainComponent Destructor.
     ~MainComponent() override {
-        edit.getTempDirectory(false).deleteRecursively();
+        exportJob.reset();
+        
+        // Nothing to save or clean up if the window closed before the engine came up.
+        if(edit == nullptr)
+            return;
+        
+        // Keep the session and its proxies for the next launch, or clean up if there is nothing worth resuming.
+        if(!loaded || !Session::save(*edit)) {
+            Session::clear();
+            edit->getTempDirectory(false).deleteRecursively();
+        }
+        
+        transport->removeChangeListener(this);
+        seekCache = nullptr;
+        deviceSuspender = nullptr;
+        threadPolicy = nullptr;
+        pitchShifter = nullptr;
+        effectsChain = nullptr;
+        outputMeter.setSource(nullptr);
+        hud.setSources(nullptr, nullptr, nullptr, nullptr);
+        callbackZone = nullptr;
+        automationLane = nullptr;
+        thumbnail = nullptr;
+        edit = nullptr;
     }
 
     //==============================================================================
     
     // Sets the bounds of gui elements.
     void paint (juce::Graphics& g) override {
+        frameStartMs = Time::getMillisecondCounterHiRes();
+        UiTimings::ScopedTimer timer (UiTimings::get().framePaintMs);
+        
         g.fillAll(juce::Colours::grey); // Paint background grey
         
         int x_offset = screen_width/12;
         int y_offset = screen_height/12;
         
         pitchShiftSlider.setBounds(x_offset, y_offset, screen_width - (2*x_offset), 2*y_offset);
+        compareButton.setBounds(screen_width - x_offset - 4*(x_offset+y_offset)/5, 3*y_offset + y_offset/8, 4*(x_offset+y_offset)/5, 3*y_offset/4); // Under the slider's right edge
+        
+        Rectangle<int> thumbnailBounds (x_offset, 4*y_offset, screen_width - (2*x_offset), 4*y_offset);
         
-        thumbnail.setBounds(x_offset, 4*y_offset, screen_width - (2*x_offset), 4*y_offset);
+        if(automationLane != nullptr) {
+            automationLane->setBounds(thumbnailBounds);
+        }
+        
+        if(thumbnail != nullptr) {
+            thumbnail->setBounds(thumbnailBounds);
+        }
+        else {
+            // Placeholder shown while the engine starts.
+            g.setColour(juce::Colours::darkgrey);
+            g.fillRoundedRectangle(thumbnailBounds.toFloat(), 10.0);
+            g.setColour(juce::Colours::grey);
+            g.drawText("Starting audio engine...", thumbnailBounds, Justification::centred);
+        }
+        
+        outputMeter.setBounds(x_offset, 8*y_offset + y_offset/4, screen_width - (2*x_offset), y_offset/2);
         
         loadFileButton.setBounds(x_offset, 9*y_offset, x_offset+y_offset, x_offset+y_offset); // Width and height are the average of the offsets (i.e. 2 * ((x_offset + y_offset) / 2) simplified)
+        exportButton.setBounds(2*x_offset + y_offset, 9*y_offset + (x_offset+y_offset)/4, 2*(x_offset+y_offset), (x_offset+y_offset)/2); // Sits right of the load button, vertically centred on it
+        effectsButton.setBounds(4*x_offset + 3*y_offset + x_offset/5, 9*y_offset + (x_offset+y_offset)/4, 4*(x_offset+y_offset)/5, (x_offset+y_offset)/2); // Sits right of the export button
         playPauseButton.setBounds(9*x_offset, 9*y_offset, x_offset+y_offset, x_offset+y_offset);
+        hud.setBounds(getLocalBounds());
         
+        // The window is on screen now, so bring the engine up behind it.
+        if(!engineRequested) {
+            engineRequested = true;
+            StartupTrace::mark("first frame");
+            MessageManager::callAsync([safeThis = SafePointer<MainComponent>(this)] {if(safeThis != nullptr) safeThis->initialiseEngine();});
+        }
+    }
+
+    // Children have been painted by now, so the frame is complete.
+    void paintOverChildren (juce::Graphics&) override {
+        UiTimings::get().endFrame(Time::getMillisecondCounterHiRes() - frameStartMs);
     }
 
     // Reset the screen width and height on resize.
@@ -115,8 +176,67 @@ public:
         if(k.getKeyCode() == k.spaceKey){
             playPauseButton.onClick();
         }
+        
+        // Cmd/Ctrl+P toggles the performance overlay.
+        if(k.getModifiers().isCommandDown() && k.getKeyCode() == 'P'){
+            hud.toggle();
+            return true;
+        }
+        
+        // Cmd/Ctrl+R toggles rendering the shifted audio ahead of playback.
+        if(k.getModifiers().isCommandDown() && k.getKeyCode() == 'R' && pitchShifter != nullptr){
+            pitchShifter->setRenderAhead(!pitchShifter->renderAheadEnabled.get());
+            Logger::writeToLog(String("Render-ahead ") + (pitchShifter->renderAheadEnabled.get() ? "on" : "off"));
+            return true;
+        }
+        
+        // Cmd/Ctrl+A shows or hides the pitch automation lane, slider moves during playback are recorded while it's shown.
+        if(k.getModifiers().isCommandDown() && k.getKeyCode() == 'A' && automationLane != nullptr){
+            automationLane->setVisible(!automationLane->isVisible());
+            return true;
+        }
+        
+        // Cmd/Ctrl+B switches between the original and the transposed audio.
+        if(k.getModifiers().isCommandDown() && k.getKeyCode() == 'B' && compareButton.isEnabled()){
+            compareButton.setToggleState(!compareButton.getToggleState(), sendNotification);
+            return true;
+        }
+        
+        // Cmd/Ctrl+L switches between playing the loaded file and transposing the live input.
+        if(k.getModifiers().isCommandDown() && k.getKeyCode() == 'L' && pitchShifter != nullptr){
+            setLiveInput(!pitchShifter->liveInputEnabled.get());
+            return true;
+        }
+        
+        // Cmd/Ctrl+T toggles tracing, Cmd/Ctrl+Shift+T dumps the trace to the desktop.
+        if(k.getModifiers().isCommandDown() && k.getKeyCode() == 'T'){
+            if(k.getModifiers().isShiftDown())
+                dumpTrace();
+            else
+                Tracing::Recorder::getInstance().setEnabled(!Tracing::Recorder::getInstance().isEnabled());
+            
+            return true;
+        }
         return false;
     }
+    
+    // Loads the last of the given paths that is an existing file, used for files opened from outside the app.
+    void openFiles(const StringArray& paths) {
+        // Hold on to them until the engine is up.
+        if(edit == nullptr) {
+            pendingFiles = paths;
+            return;
+        }
+        
+        for (int i = paths.size(); --i >= 0;) {
+            File f (paths[i]);
+            
+            if(f.existsAsFile()) {
+                setFile(f);
+                return;
+            }
+        }
+    }
 
 private:
     // PRIVATE MEMBER VARIABLES
@@ -129,24 +249,40 @@ private:
     // Custom LookAndFeel Class.
     ApollonLookAndFeel lnf;
     
-    // Tracktion engine objects.
-    te::Engine engine {ProjectInfo::projectName};
-    te::Edit edit {engine, te::createEmptyEdit (engine), te::Edit::forEditing, nullptr, 0};
-    te::TransportControl& transport {edit.getTransport()};
-
-    // File chooser for loading audio files.
-    FileChooser audioFileChooser { "Load an audio file...",
-                                   engine.getPropertyStorage().getDefaultLoadSaveDirectory ("apollon"),
-                                   engine.getAudioFileFormatManager().readFormatManager.getWildcardForAllFormats() };
+    // Tracktion engine objects, created after the first frame so the window appears without waiting for them.
+    std::unique_ptr<te::Engine> engine;
+    std::unique_ptr<te::Edit> edit;
+    te::TransportControl* transport = nullptr;
+    std::unique_ptr<Tracing::CallbackZone> callbackZone;
+    std::unique_ptr<DeviceSuspender> deviceSuspender;
+    std::unique_ptr<ThreadPolicy::Reporter> threadPolicy;
+    std::unique_ptr<SeekCache::Builder> seekCache;
+    ReferenceCountedObjectPtr<ApollonPitchShiftPlugin> pitchShifter;
+    ReferenceCountedObjectPtr<EffectsChainPlugin> effectsChain;
 
     // GUI elements.
     ImageButton playPauseButton, loadFileButton;
-    Thumbnail thumbnail {transport};
+    TextButton exportButton {"export"}, effectsButton {"fx"}, compareButton {"A/B"};
+    std::unique_ptr<Thumbnail> thumbnail;
+    std::unique_ptr<PitchAutomationLane> automationLane;
     Slider pitchShiftSlider;
+    LevelMeter outputMeter;
+    PerformanceHud hud;
+    double frameStartMs = 0.0;
     
     // Booloean that keeps track of wether an audio track was loaded into the transport.
     bool loaded = false;
     
+    // Whether the engine start has been scheduled, and files that were opened before it was ready.
+    bool engineRequested = false;
+    StringArray pendingFiles;
+    
+    // The clip currently in track 0, and the export rendering it if one is running.
+    te::WaveAudioClip::Ptr currentClip;
+    std::unique_ptr<ExportJob> exportJob;
+    int exportId = 0;
+    te::LambdaTimer exportProgressUpdater;
+    
     // Create the images to display for the play/pause and load file buttons.
     Image load_white = ImageCache::getFromMemory(BinaryData::load_white_png, BinaryData::load_white_pngSize);
     Image load_black = ImageCache::getFromMemory(BinaryData::load_black_png, BinaryData::load_black_pngSize);
@@ -163,29 +299,197 @@ private:
     // PRIVATE MEMBER FUNCTIONS
     //==============================================================================
     
+    // Brings up the engine, the audio device and the edit, then enables playback. Runs once, just after the first frame.
+    void initialiseEngine() {
+        StartupTrace::mark("engine start");
+        engine = std::make_unique<te::Engine> (ProjectInfo::projectName);
+        StartupTrace::mark("engine and audio device ready");
+        
+        // Registered before the edit loads so the saved pitch shifter, effects chain and meter come back with it. The airwindows effects are registered by the engine itself.
+        engine->getPluginManager().createBuiltInType<ApollonPitchShiftPlugin>();
+        engine->getPluginManager().createBuiltInType<EffectsChainPlugin>();
+        engine->getPluginManager().createBuiltInType<OutputMeterPlugin>();
+        
+        // Pin and prioritise the audio threads as configured, and log whether the system allowed it.
+        threadPolicy = std::make_unique<ThreadPolicy::Reporter> (ThreadPolicy::Settings::load (*engine));
+        
+        // Time each audio callback in traces.
+        callbackZone = std::make_unique<Tracing::CallbackZone> (*engine);
+        
+        edit = std::make_unique<te::Edit> (*engine, Session::loadEditState (*engine), te::Edit::forEditing, nullptr, 0);
+        transport = &edit->getTransport();
+        StartupTrace::mark("edit loaded");
+        
+        // Registers this ChangeListener with the audio transport.
+        transport->addChangeListener(this);
+        
+        // Compressed files get a seekable copy in the background, and play from it once it's ready, so jumping around in them stays instant.
+        seekCache = std::make_unique<SeekCache::Builder> (*engine);
+        seekCache->onCopyReady = [this] (const File& source, const File& copy) {playFromCopy(source, copy);};
+        
+        // Release the audio device when paused for long enough, to save power.
+        deviceSuspender = std::make_unique<DeviceSuspender> (*edit);
+        
+        thumbnail = std::make_unique<Thumbnail> (*transport);
+        addAndMakeVisible(*thumbnail);
+        
+        // Setup pitch shifting.
+        {
+            // Reuse the plugin from a restored session, or create a new instance and insert it in track 1.
+            auto track = Helpers::getOrInsertAudioTrackAt(*edit, 0);
+            auto pitchShiftPlugin = ApollonPitchShiftPlugin::getOrInsert(*track);
+            pitchShifter = pitchShiftPlugin;
+            
+            // Let MIDI controllers drive the transposition and the transport.
+            pitchShiftPlugin->onTransportCommand = [this] (MidiPitchMapping::TransportCommand c) {handleMidiTransportCommand(c);};
+            
+            Helpers::routeMidiInputsToTrack(*edit, *track);
+            
+            // Effects run after the pitch shifter, reusing the chain restored with the session.
+            effectsChain = EffectsChainPlugin::getOrInsert(*track, *pitchShiftPlugin);
+            
+            // Meter the output of the whole track, after the pitch shifter and the track's own volume.
+            te::Plugin::Ptr meterPlugin = track->pluginList.findFirstPluginOfType<OutputMeterPlugin>();
+            
+            if (meterPlugin == nullptr) {
+                meterPlugin = edit->getPluginCache().createNewPlugin(OutputMeterPlugin::xmlTypeName, {});
+                track->pluginList.insertPlugin(meterPlugin, -1, nullptr);
+            }
+            
+            if (auto m = dynamic_cast<OutputMeterPlugin*> (meterPlugin.get()))
+                outputMeter.setSource(&m->levels);
+            
+            hud.setSources(engine.get(), callbackZone.get(), pitchShiftPlugin, effectsChain.get());
+            
+            // The cursor follows the audio clock, delayed by the pitch shifter's latency.
+            thumbnail->setPlayheadSource(&pitchShiftPlugin->playhead, pitchShiftPlugin);
+            
+            // Connect slider value.
+            auto pitchShiftParam = pitchShiftPlugin->getAutomatableParameterByID ("semitones up");
+            const double initialSemitones = pitchShiftParam->getCurrentValue(); // Zero unless restored from the last session
+            bindSliderToParameter(pitchShiftSlider, *pitchShiftParam);
+            pitchShiftSlider.setSkewFactorFromMidPoint(0.0);
+            
+            
+            // Binding replaced the slider's range, so put back the -4 to 4 transposition range.
+            pitchShiftSlider.setRange(-4.0, 4.0);
+            pitchShiftSlider.setValue(initialSemitones);
+            
+            // The automation is drawn over the waveform, under the performance overlay, on the slider's range.
+            automationLane = std::make_unique<PitchAutomationLane> (pitchShiftPlugin->automation, *transport, Range<float> (-4.0f, 4.0f));
+            addChildComponent(*automationLane, getIndexOfChildComponent(&hud));
+            
+            // Holding the slider holds the automation off, and records over it during playback while the lane is shown.
+            pitchShiftSlider.onDragStart = [this] {pitchShifter->automation.beginTouch(transport->isPlaying() && automationLane->isVisible());};
+            pitchShiftSlider.onValueChange = [this] {if(pitchShifter->automation.isTouched()) pitchShifter->automation.touch(transport->getCurrentPosition(), (float) pitchShiftSlider.getValue());};
+            pitchShiftSlider.onDragEnd = [this] {pitchShifter->automation.endTouch();};
+            
+        }
+        
+        StartupTrace::mark("plugins ready");
+        
+        // Pick up the clip from the last session, if there was one, or the files opened while starting.
+        restoreClip();
+        
+        // Pick live-input mode back up if the last session was in it.
+        if(pitchShifter->liveInputEnabled.get())
+            setLiveInput(true);
+        
+        openFiles(pendingFiles);
+        pendingFiles.clear();
+        
+        playPauseButton.setEnabled(true);
+        loadFileButton.setEnabled(true);
+        pitchShiftSlider.setEnabled(true);
+        effectsButton.setEnabled(effectsChain != nullptr);
+        compareButton.setEnabled(true);
+        updatePlayButtonText();
+        outputMeter.setActive(transport->isPlaying());
+        repaint();
+        
+        StartupTrace::mark("ready to play");
+        StartupTrace::report();
+    }
+
+    // Writes the recorded trace to a timestamped file on the desktop.
+    void dumpTrace() {
+        auto f = File::getSpecialLocation(File::userDesktopDirectory)
+                     .getChildFile("apollon-trace-" + Time::getCurrentTime().formatted("%Y%m%d-%H%M%S") + ".json");
+        
+        if(Tracing::Recorder::getInstance().dump(f))
+            Logger::writeToLog("Trace written to " + f.getFullPathName());
+    }
+    
     // Sets the file in the transport, if possible.
     void setFile(const File& f) {
-        if(auto clip = Helpers::loadAudioFileAsClip(edit, f)) {
-            clip->setAutoTempo(false);
-            clip->setAutoPitch(false);
-            clip->setTimeStretchMode(te::TimeStretcher::melodyne);
+        // The render uses the clip being replaced, so wait for it to stop.
+        if(exportJob != nullptr) {
+            ++exportId;
+            exportFinished(false, true, {});
+        }
+        
+        // Loading a file means going back to playing files.
+        if(pitchShifter->liveInputEnabled.get())
+            setLiveInput(false);
+        
+        currentClip = Helpers::loadAudioFileAsClip(*edit, f);
+        
+        if(auto clip = currentClip) {
+            Helpers::preparePitchShiftClip(*clip);
+            pitchShifter->automation.clear(); // The last file's key changes don't belong to this one
+            seekCache->prepare(f, getPreconvertRate());
             
-            thumbnail.setFile(Helpers::loopAroundClip (*clip)->getPlaybackFile());
+            thumbnail->setFile(Helpers::loopAroundClip (*clip)->getPlaybackFile(), f);
+            pitchShifter->updateRenderAheadSource();
         }
         else {
-            thumbnail.setFile({engine});
+            thumbnail->setFile({*engine});
         }
         
         // If the file exists then it was loaded, update loaded boolean accordingly.
         f.exists() ? loaded = true : loaded = false;
-        transport.stop(false, false);
+        exportButton.setEnabled(currentClip != nullptr);
+        transport->stop(false, false);
+    }
+    
+    // Returns the device's rate if loaded files should be converted to it in the background, otherwise 0.
+    double getPreconvertRate() {
+        if(!Resampling::shouldPreconvert(*engine))
+            return 0.0;
+        
+        auto device = engine->getDeviceManager().deviceManager.getCurrentAudioDevice();
+        return device != nullptr ? device->getCurrentSampleRate() : 0.0;
+    }
+    
+    // Shows the clip restored with the session without touching its loop range or position, or clears it if its file has gone.
+    void restoreClip() {
+        auto track = Helpers::getOrInsertAudioTrackAt(*edit, 0);
+        auto clip = dynamic_cast<te::WaveAudioClip*> (track->getClips().getFirst());
+        
+        if(clip == nullptr)
+            return;
+        
+        if(!SeekCache::getSourceFile(*clip).existsAsFile()) {
+            Helpers::removeAllClips(*track);
+            return;
+        }
+        
+        // The copy it was playing may have been pruned, or made for another device rate or quality. The source is played until the right one is ready.
+        SeekCache::playFromSource(*clip);
+        
+        currentClip = clip;
+        seekCache->prepare(SeekCache::getSourceFile(*clip), getPreconvertRate());
+        thumbnail->setFile(clip->getPlaybackFile(), SeekCache::getSourceFile(*clip));
+        loaded = true;
+        exportButton.setEnabled(true);
+        transport->looping = true;
     }
     
     // Sets the play/pause image button to its normal state, and updates its images based on wether audio is being played.
     void updatePlayButtonText() {
         playPauseButton.setState(Button::ButtonState::buttonNormal); // The state of the play/pause button never changes, just the button images change
         
-        if(transport.isPlaying())
+        if(transport != nullptr && transport->isPlaying())
             playPauseButton.setImages(false, true, false, pause_white, 1.0f, {}, pause_black, 1.0f, {}, pause_white, 1.0f, {});
         else
             playPauseButton.setImages(false, true, false, play_white, 1.0f, {}, play_black, 1.0f, {}, play_white, 1.0f, {});
@@ -194,12 +498,177 @@ private:
     
     // Called when the user does not chose a valid file after clicking the load file button.
     void noFileChosen() {
-        thumbnail.clearFile();
+        thumbnail->clearFile();
         loaded = false;
     }
     
+    // Asks where to export the transposed clip, then starts rendering it.
+    void browseForExportFile() {
+        if(currentClip == nullptr)
+            return;
+        
+        auto fc = std::make_shared<FileChooser> ("Export transposed audio...",
+                                                 SeekCache::getSourceFile(*currentClip).getSiblingFile(currentClip->getName() + " (transposed).wav"),
+                                                 "*.wav;*.flac");
+        
+        fc->launchAsync(FileBrowserComponent::saveMode + FileBrowserComponent::canSelectFiles + FileBrowserComponent::warnAboutOverwriting,
+                        [this, fc] (const FileChooser&) {
+                            auto f = fc->getResult();
+                            
+                            if(f != File() && currentClip != nullptr)
+                                startExport(ExportJob::isSupportedFile(f) ? f : f.withFileExtension("wav"));
+                        });
+    }
+    
+    // Renders the current clip through the pitch shifter on a background thread.
+    void startExport(const File& f) {
+        transport->stop(false, false); // Rendering uses its own graph, so the live one is stopped first
+        
+        exportJob = std::make_unique<ExportJob> (*currentClip, f,
+                                                 [safeThis = SafePointer<MainComponent>(this), id = ++exportId] (bool succeeded, bool cancelled, const String& error) {
+                                                     // A job stopped by loading a file reports after it's gone, and mustn't end the next one.
+                                                     if(safeThis != nullptr && safeThis->exportId == id)
+                                                         safeThis->exportFinished(succeeded, cancelled, error);
+                                                 });
+        exportJob->start();
+        exportProgressUpdater.startTimerHz(10);
+    }
+    
+    // Called when an export ends, restores the export button and reports failures.
+    void exportFinished(bool succeeded, bool cancelled, const String& error) {
+        exportProgressUpdater.stopTimer();
+        exportJob.reset();
+        exportButton.setButtonText("export");
+        
+        if(!succeeded && !cancelled)
+            AlertWindow::showMessageBoxAsync(AlertWindow::WarningIcon, "Export failed", Helpers::getStringOrDefault(error, "The file could not be rendered."));
+    }
+    
+    // Runs a transport command sent from a MIDI controller, ignored until a file is loaded.
+    void handleMidiTransportCommand(MidiPitchMapping::TransportCommand command) {
+        if(!loaded)
+            return;
+        
+        switch(command) {
+            case MidiPitchMapping::TransportCommand::play:   transport->play(false); break;
+            case MidiPitchMapping::TransportCommand::stop:   transport->stop(false, false); break;
+            case MidiPitchMapping::TransportCommand::toggle: Helpers::togglePlay(*edit); break;
+            case MidiPitchMapping::TransportCommand::none:   break;
+        }
+    }
+    
+    // Plays the current clip from a seekable or converted copy, if it's a copy of the clip's file.
+    void playFromCopy(const File& source, const File& copy) {
+        if(currentClip == nullptr || SeekCache::getSourceFile(*currentClip) != source || currentClip->getOriginalFile() == copy)
+            return;
+        
+        SeekCache::playFromCopy(*currentClip, copy);
+        pitchShifter->updateRenderAheadSource();
+        Logger::writeToLog("Playing " + source.getFileName() + " from its cached copy");
+    }
+    
+    // Sets how files whose rate differs from the device's are converted, and converts the loaded one again if needed.
+    void setResampling(Resampling::Quality quality, bool preconvert) {
+        Resampling::setQuality(*engine, quality);
+        Resampling::setPreconvert(*engine, preconvert);
+        
+        if(currentClip == nullptr)
+            return;
+        
+        // Back to the source until a copy made with the new settings is ready.
+        SeekCache::playFromSource(*currentClip);
+        pitchShifter->updateRenderAheadSource();
+        seekCache->prepare(SeekCache::getSourceFile(*currentClip), getPreconvertRate());
+        
+        // Render-ahead picks its realtime quality up when playback is rebuilt.
+        edit->restartPlayback();
+    }
+    
+    // Adds the resampling settings to a menu.
+    void addResamplingMenu(PopupMenu& menu) {
+        PopupMenu resamplingMenu;
+        const auto current = Resampling::getQuality(*engine);
+        const bool preconvert = Resampling::shouldPreconvert(*engine);
+        
+        for (auto q : { Resampling::Quality::linear, Resampling::Quality::lagrange, Resampling::Quality::sinc })
+            resamplingMenu.addItem(Resampling::getName(q), true, q == current, [this, q, preconvert] {setResampling(q, preconvert);});
+        
+        resamplingMenu.addSeparator();
+        resamplingMenu.addItem("Convert files to the device rate", true, preconvert, [this, current, preconvert] {setResampling(current, !preconvert);});
+        
+        menu.addSubMenu("Resampling", resamplingMenu);
+    }
+    
+    // Shows the effects after the pitch shifter with what each costs per block, and lets them be added, bypassed or removed.
+    void showEffectsMenu() {
+        if(effectsChain == nullptr)
+            return;
+        
+        PopupMenu menu, addMenu;
+        auto available = EffectsChainPlugin::getAvailableEffects();
+        
+        for (int i = 0; i < available.size(); ++i)
+            addMenu.addItem(available[i].name, [this, type = String(available[i].type)] {effectsChain->addEffect(type);});
+        
+        menu.addSubMenu("Add effect", addMenu);
+        
+        for (int i = 0; i < effectsChain->getNumEffects(); ++i) {
+            auto fx = effectsChain->getEffectInfo(i);
+            auto cost = String(roundToInt(fx.microsPerBlock)) + " us/block, " + String(roundToInt(fx.load * 100.0f)) + "%";
+            
+            PopupMenu effectMenu;
+            effectMenu.addItem(fx.bypassed ? "Enable" : "Bypass", [this, i, bypassed = fx.bypassed] {effectsChain->setBypassed(i, !bypassed);});
+            effectMenu.addItem("Remove", [this, i] {effectsChain->removeEffect(i);});
+            
+            menu.addSubMenu(fx.name + " (" + (fx.autoBypassed ? "over budget, bypassed" : cost) + ")", effectMenu, true, nullptr, fx.bypassed);
+        }
+        
+        menu.addSeparator();
+        addResamplingMenu(menu);
+        
+        menu.showMenuAsync(PopupMenu::Options().withTargetComponent(&effectsButton));
+    }
+    
+    // Feeds track 0 from the audio inputs through the low-latency shifter, or goes back to the file, and logs the latency a performer will hear.
+    void setLiveInput(bool live) {
+        auto track = Helpers::getOrInsertAudioTrackAt(*edit, 0);
+        
+        transport->stop(false, false);
+        wakeAudioDevice();
+        
+        // The clip stays loaded for when live mode is switched off, it's just not heard.
+        if(currentClip != nullptr)
+            currentClip->setMuted(live);
+        
+        Helpers::routeAudioInputsToTrack(*edit, *track, live);
+        pitchShifter->setLiveInput(live);
+        
+        if(live) {
+            const auto processing = pitchShifter->getLiveLatencySeconds() + (effectsChain != nullptr ? effectsChain->getLatencySeconds() : 0.0);
+            Logger::writeToLog("Live input on, shifter adds " + String(pitchShifter->getLiveLatencySeconds() * 1000.0, 1) + " ms, "
+                               + String(LiveInput::getEndToEndLatencySeconds(*engine, processing) * 1000.0, 1) + " ms input to output");
+        }
+        else {
+            Logger::writeToLog("Live input off");
+        }
+    }
+    
+    // Reopens the audio device if it was released while idle.
+    void wakeAudioDevice() {
+        if(deviceSuspender != nullptr)
+            deviceSuspender->wake();
+    }
+    
+    // Called when the transport starts or stops, only keeps the UI timers running while there is audio to follow.
     void changeListenerCallback(ChangeBroadcaster*) override {
         updatePlayButtonText();
+        outputMeter.setActive(transport->isPlaying());
+        
+        if(thumbnail != nullptr)
+            thumbnail->transportStateChanged();
+        
+        if(pitchShifter != nullptr)
+            pitchShifter->updateRenderAheadSource();
     }
     //==============================================================================
 
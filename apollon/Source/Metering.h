@@ -0,0 +1,310 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+namespace te = tracktion_engine;
+
+//==============================================================================
+/**
+        Levels published by the audio thread for the meter to read.
+        Every value is an individual atomic so neither side ever waits on the other.
+*/
+//==============================================================================
+struct MeterLevels {
+    static constexpr int maxChannels = 2;
+
+    std::atomic<float> peak[maxChannels] {};     // Highest absolute sample since the UI last read it.
+    std::atomic<float> rms[maxChannels] {};      // RMS of the most recent block.
+    std::atomic<float> shortTermLufs { -100.0f };  // Loudness over the last 3 seconds, K-weighted.
+    std::atomic<bool> clipped { false };         // Set when any sample reaches 0 dBFS, cleared by the UI.
+
+    // Stores the larger of the current and new peak, so peaks between two UI reads are never lost.
+    void pushPeak (int channel, float value) noexcept {
+        auto current = peak[channel].load (std::memory_order_relaxed);
+
+        while (value > current && ! peak[channel].compare_exchange_weak (current, value, std::memory_order_relaxed)) {}
+    }
+};
+//==============================================================================
+/**
+        Vectorised level helpers used on the audio thread.
+*/
+//==============================================================================
+namespace Metering {
+
+    // Returns the largest absolute sample in the range.
+    static inline float getPeak (const float* data, int numSamples) noexcept {
+        auto range = FloatVectorOperations::findMinAndMax (data, numSamples);
+        return jmax (-range.getStart(), range.getEnd());
+    }
+
+    // Returns the sum of squares of the range, using SIMD registers for the aligned part.
+    static inline float getSumOfSquares (const float* data, int numSamples) noexcept {
+        using Reg = dsp::SIMDRegister<float>;
+
+        float sum = 0.0f;
+        int i = 0;
+
+        // Scalar head until the pointer is aligned for SIMD loads.
+        for (; i < numSamples && ! Reg::isSIMDAligned (data + i); ++i)
+            sum += data[i] * data[i];
+
+        auto acc = Reg::expand (0.0f);
+
+        for (; i + (int) Reg::SIMDNumElements <= numSamples; i += (int) Reg::SIMDNumElements) {
+            auto v = Reg::fromRawArray (data + i);
+            acc = acc + v * v;
+        }
+
+        sum += acc.sum();
+
+        for (; i < numSamples; ++i)
+            sum += data[i] * data[i];
+
+        return sum;
+    }
+
+    // Returns the two ITU-R BS.1770 K-weighting stages (high shelf then high pass) for the given sample rate.
+    static inline std::pair<dsp::IIR::Coefficients<float>::Ptr, dsp::IIR::Coefficients<float>::Ptr> makeKWeighting (double sampleRate) {
+        const double pi = MathConstants<double>::pi;
+
+        double K = std::tan (pi * 1681.974450955533 / sampleRate);
+        double Q = 0.7071752369554196;
+        const double Vh = std::pow (10.0, 3.999843853973347 / 20.0);
+        const double Vb = std::pow (Vh, 0.4996667741545416);
+        double a0 = 1.0 + K / Q + K * K;
+
+        auto shelf = new dsp::IIR::Coefficients<float> ((float) ((Vh + Vb * K / Q + K * K) / a0),
+                                                        (float) (2.0 * (K * K - Vh) / a0),
+                                                        (float) ((Vh - Vb * K / Q + K * K) / a0),
+                                                        1.0f,
+                                                        (float) (2.0 * (K * K - 1.0) / a0),
+                                                        (float) ((1.0 - K / Q + K * K) / a0));
+
+        K = std::tan (pi * 38.13547087602444 / sampleRate);
+        Q = 0.5003270373238773;
+        a0 = 1.0 + K / Q + K * K;
+
+        auto highPass = new dsp::IIR::Coefficients<float> (1.0f, -2.0f, 1.0f,
+                                                           1.0f,
+                                                           (float) (2.0 * (K * K - 1.0) / a0),
+                                                           (float) ((1.0 - K / Q + K * K) / a0));
+
+        return { shelf, highPass };
+    }
+}
+//==============================================================================
+/**
+    Pass-through plugin placed at the end of track 0 that measures the signal leaving the chain.
+    Peak and RMS are computed per block, short-term loudness over a sliding 3 second window
+    made of 100 ms bins, so the audio thread only ever does a fixed amount of work per block.
+*/
+//==============================================================================
+class OutputMeterPlugin  : public te::Plugin {
+public:
+
+    OutputMeterPlugin (te::PluginCreationInfo info)
+        : te::Plugin (info) {
+    }
+
+    ~OutputMeterPlugin() override {
+        notifyListenersOfDeletion();
+    }
+
+    static inline const char* xmlTypeName = "apollonOutputMeter";
+
+    juce::String getName() override                                 { return TRANS("Output Meter"); }
+    juce::String getPluginType() override                           { return xmlTypeName; }
+    juce::String getShortName (int) override                        { return TRANS("Meter"); }
+    juce::String getSelectableDescription() override                { return getName(); }
+    bool needsConstantBufferSize() override                         { return false; }
+    int getNumOutputChannelsGivenInputs (int numInputChannels) override { return numInputChannels; }
+
+    MeterLevels levels;
+
+    void initialise (const te::PluginInitialisationInfo& info) override {
+        auto weighting = Metering::makeKWeighting (info.sampleRate);
+
+        for (auto& f : shelfFilters)    { f.coefficients = weighting.first;  f.reset(); }
+        for (auto& f : highPassFilters) { f.coefficients = weighting.second; f.reset(); }
+
+        // Scratch space for the K-weighted copy, sized once here so the audio thread never allocates.
+        weighted.setSize (1, jmax (info.blockSizeSamples, 8192), false, false, false);
+
+        samplesPerBin = jmax (1, roundToInt (info.sampleRate * 0.1));
+        std::fill (std::begin (bins), std::end (bins), 0.0);
+        binSum = 0.0;
+        binSamples = 0;
+        binIndex = 0;
+    }
+
+    void deinitialise() override {}
+
+    void applyToBuffer (const te::PluginRenderContext& fc) override {
+        if (fc.destBuffer == nullptr || fc.bufferNumSamples == 0)
+            return;
+
+        const int numChannels = jmin (fc.destBuffer->getNumChannels(), MeterLevels::maxChannels);
+        const int numSamples = jmin (fc.bufferNumSamples, weighted.getNumSamples());
+        double weightedSum = 0.0;
+
+        for (int ch = 0; ch < numChannels; ++ch) {
+            auto* data = fc.destBuffer->getReadPointer (ch, fc.bufferStartSample);
+
+            const auto peak = Metering::getPeak (data, numSamples);
+            levels.pushPeak (ch, peak);
+            levels.rms[ch].store (std::sqrt (Metering::getSumOfSquares (data, numSamples) / (float) numSamples), std::memory_order_relaxed);
+
+            if (peak >= 1.0f)
+                levels.clipped.store (true, std::memory_order_relaxed);
+
+            // K-weight a copy of the channel for the loudness measurement.
+            auto* w = weighted.getWritePointer (0);
+            FloatVectorOperations::copy (w, data, numSamples);
+
+            for (int i = 0; i < numSamples; ++i)
+                w[i] = highPassFilters[ch].processSample (shelfFilters[ch].processSample (w[i]));
+
+            weightedSum += Metering::getSumOfSquares (w, numSamples);
+        }
+
+        addToLoudnessWindow (weightedSum, numSamples);
+    }
+
+    void restorePluginStateFromValueTree (const juce::ValueTree&) override {}
+
+private:
+    static constexpr int numBins = 30; // 30 x 100 ms = 3 s short-term window.
+
+    dsp::IIR::Filter<float> shelfFilters[MeterLevels::maxChannels], highPassFilters[MeterLevels::maxChannels];
+    AudioBuffer<float> weighted;
+
+    double bins[numBins] {};
+    double binSum = 0.0;
+    int samplesPerBin = 4410, binSamples = 0, binIndex = 0;
+
+    // Accumulates the block into the current 100 ms bin and republishes the window each time a bin completes.
+    void addToLoudnessWindow (double sumOfSquares, int numSamples) noexcept {
+        binSum += sumOfSquares;
+        binSamples += numSamples;
+
+        if (binSamples < samplesPerBin)
+            return;
+
+        bins[binIndex] = binSum / binSamples;
+        binIndex = (binIndex + 1) % numBins;
+        binSum = 0.0;
+        binSamples = 0;
+
+        double meanSquare = 0.0;
+
+        for (auto b : bins)
+            meanSquare += b;
+
+        meanSquare /= numBins;
+
+        const auto lufs = meanSquare > 0.0 ? (float) (-0.691 + 10.0 * std::log10 (meanSquare)) : -100.0f;
+        levels.shortTermLufs.store (jmax (-100.0f, lufs), std::memory_order_relaxed);
+    }
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (OutputMeterPlugin)
+};
+//==============================================================================
+/**
+        Lightweight horizontal meter drawing the levels published by an OutputMeterPlugin.
+*/
+//==============================================================================
+struct LevelMeter    : public Component,
+                       private Timer {
+
+    LevelMeter() {
+        startTimerHz (30);
+    }
+
+    // Polls while the audio is running. Once it's switched off the meter keeps going until its bars have fallen to silence, then stops.
+    void setActive (bool shouldBeActive) {
+        active = shouldBeActive;
+
+        if (active)
+            startTimerHz (30);
+    }
+
+    // Points the meter at a set of levels, or nullptr to show nothing.
+    void setSource (MeterLevels* newSource) {
+        source = newSource;
+        repaint();
+    }
+
+    void paint (Graphics& g) override {
+        auto r = getLocalBounds().toFloat();
+
+        g.setColour (juce::Colours::darkgrey);
+        g.fillRoundedRectangle (r, 4.0f);
+
+        auto bars = r.reduced (4.0f, 2.0f);
+        auto text = bars.removeFromRight (jmin (70.0f, bars.getWidth() / 3.0f));
+        const float barHeight = bars.getHeight() / MeterLevels::maxChannels;
+
+        for (int ch = 0; ch < MeterLevels::maxChannels; ++ch) {
+            auto bar = bars.removeFromTop (barHeight).reduced (0.0f, 1.0f);
+
+            g.setColour (juce::Colours::black);
+            g.fillRect (bar.withWidth (bar.getWidth() * toProportion (rms[ch])));
+
+            g.setColour (juce::Colours::orange);
+            g.fillRect (bar.withX (bar.getX() + bar.getWidth() * toProportion (peak[ch])).withWidth (2.0f));
+        }
+
+        g.setColour (clipped ? juce::Colours::red : juce::Colours::white);
+        g.setFont (jmin (12.0f, r.getHeight()));
+        g.drawText (lufs <= -100.0f ? String ("-inf LUFS") : String (lufs, 1) + " LUFS", text, Justification::centredRight);
+    }
+
+    void mouseDown (const MouseEvent&) override {
+        // Clicking the meter resets the clip indicator.
+        if (source != nullptr)
+            source->clipped = false;
+
+        clipped = false;
+        repaint();
+    }
+
+private:
+    MeterLevels* source = nullptr;
+    float peak[MeterLevels::maxChannels] {}, rms[MeterLevels::maxChannels] {};
+    float lufs = -100.0f;
+    bool clipped = false;
+    bool active = true;
+
+    // Maps a linear gain onto the -60..0 dB width of the meter.
+    static float toProportion (float gain) {
+        return jlimit (0.0f, 1.0f, (Decibels::gainToDecibels (gain, -60.0f) + 60.0f) / 60.0f);
+    }
+
+    void timerCallback() override {
+        if (source == nullptr)
+            return;
+
+        for (int ch = 0; ch < MeterLevels::maxChannels; ++ch) {
+            // Peaks fall back smoothly rather than jumping to the latest block.
+            peak[ch] = jmax (source->peak[ch].exchange (0.0f, std::memory_order_relaxed), peak[ch] * 0.85f);
+            rms[ch] = source->rms[ch].load (std::memory_order_relaxed);
+        }
+
+        lufs = source->shortTermLufs.load (std::memory_order_relaxed);
+        clipped = clipped || source->clipped.load (std::memory_order_relaxed);
+        repaint();
+
+        if (! active && isSilent())
+            stopTimer();
+    }
+
+    bool isSilent() const {
+        for (int ch = 0; ch < MeterLevels::maxChannels; ++ch)
+            if (peak[ch] > 0.001f || rms[ch] > 0.001f)
+                return false;
+
+        return true;
+    }
+};
+//==============================================================================
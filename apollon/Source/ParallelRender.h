@@ -0,0 +1,289 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "ThreadPolicy.h"
+#include "SeekCache.h"
+
+namespace te = tracktion_engine;
+
+//==============================================================================
+/**
+    Offline pitch shift of one long file spread across every core.
+
+    The file is cut into segments that are shifted concurrently, each by its own te::TimeStretcher
+    set up like the PitchShiftPlugin. Every segment starts its stretcher a little early so it has
+    settled by the time its own region begins, and neighbouring segments overlap and are joined
+    with a linear crossfade. Segments are written in order as they finish, so memory stays bounded
+    by the number of segments in flight rather than by the length of the file.
+*/
+//==============================================================================
+class ParallelPitchRenderer {
+public:
+
+    struct Settings {
+        float semitones = 0.0f;
+        te::TimeStretcher::Mode mode = te::TimeStretcher::melodyne;
+        double segmentSeconds = 30.0;  // Length of the region each job is responsible for.
+        double overlapSeconds = 0.5;   // Length of the crossfade between neighbouring segments.
+        double preRollSeconds = 1.0;   // Input fed to each stretcher before its region so it has settled.
+        int numThreads = SystemStats::getNumCpus();
+
+        // Returns settings that match the given plugin.
+        static Settings fromPlugin (te::PitchShiftPlugin& plugin) {
+            Settings s;
+            s.semitones = plugin.semitones->getCurrentValue();
+            s.mode = (te::TimeStretcher::Mode) plugin.mode.get();
+            return s;
+        }
+    };
+
+    ParallelPitchRenderer (te::Engine& e, Settings s)
+        : engine (e), settings (s) {
+    }
+
+    // Renders input to output, updating progress from 0 to 1. Returns an error message, or an empty string on success.
+    // Stops early and returns an error if shouldCancel returns true.
+    String render (const File& input, const File& output, std::atomic<float>* progress = nullptr, std::function<bool()> shouldCancel = nullptr) {
+        auto& formats = engine.getAudioFileFormatManager();
+
+        // Every segment seeks to its own start, so read a compressed input through its copy when there is one.
+        const auto source = SeekCache::resolve (engine, input);
+        std::unique_ptr<AudioFormatReader> reader (formats.readFormatManager.createReaderFor (source));
+
+        if (reader == nullptr)
+            return TRANS("Couldn't read") + " " + input.getFileName();
+
+        const double sampleRate = reader->sampleRate;
+        const int numChannels = (int) reader->numChannels;
+        const int64 length = reader->lengthInSamples;
+        reader.reset();
+
+        output.deleteFile();
+        auto* format = output.hasFileExtension ("flac") ? formats.getFlacFormat() : formats.getWavFormat();
+        std::unique_ptr<AudioFormatWriter> writer (format->createWriterFor (output.createOutputStream().release(), sampleRate,
+                                                                            (unsigned int) numChannels, 24, {}, 0));
+
+        if (writer == nullptr)
+            return TRANS("Couldn't write") + " " + output.getFileName();
+
+        const int64 segment = jmax ((int64) 1, (int64) (settings.segmentSeconds * sampleRate));
+        const int halfOverlap = jmax (1, roundToInt (settings.overlapSeconds * sampleRate / 2.0));
+        const int preRoll = roundToInt (settings.preRollSeconds * sampleRate);
+        const int latency = measureLatency (settings, sampleRate, numChannels);
+
+        // The last segment absorbs the remainder, so no segment is ever shorter than a crossfade.
+        const int numSegments = (int) jmax ((int64) 1, length / segment);
+
+        OwnedArray<SegmentJob> jobs;
+        ThreadPool pool (jmax (1, settings.numThreads));
+
+        for (int i = 0; i < numSegments; ++i) {
+            const int64 a = i * segment, b = (i == numSegments - 1) ? length : a + segment;
+            jobs.add (new SegmentJob (*this, source, sampleRate, numChannels, length,
+                                      a, b, halfOverlap, preRoll, latency, i > 0, i < numSegments - 1));
+        }
+
+        // Keep a couple of segments queued per thread so no core goes idle while the writer catches up.
+        const int maxInFlight = pool.getNumThreads() * 2;
+        int nextToQueue = 0;
+
+        AudioBuffer<float> tail;
+        int64 written = 0;
+        String error;
+
+        for (int i = 0; i < numSegments && error.isEmpty(); ++i) {
+            while (nextToQueue < numSegments && nextToQueue < i + maxInFlight)
+                pool.addJob (jobs[nextToQueue++], false);
+
+            auto& job = *jobs[i];
+
+            while (! job.finished.wait (100)) {
+                if (shouldCancel != nullptr && shouldCancel()) {
+                    error = TRANS("Cancelled");
+                    break;
+                }
+            }
+
+            if (error.isNotEmpty())
+                break;
+
+            if (job.error.isNotEmpty()) {
+                error = job.error;
+                break;
+            }
+
+            // The start of this segment overlaps the held tail of the previous one, mix them before writing.
+            auto& result = job.result;
+
+            for (int ch = 0; ch < numChannels; ++ch)
+                result.addFrom (ch, 0, tail, ch, 0, jmin (tail.getNumSamples(), result.getNumSamples()));
+
+            // Hold back the part the next segment will crossfade into.
+            const int held = job.fadesOut ? jmin (2 * halfOverlap, result.getNumSamples()) : 0;
+            const int toWrite = result.getNumSamples() - held;
+
+            writer->writeFromAudioSampleBuffer (result, 0, toWrite);
+            written += toWrite;
+
+            tail.setSize (numChannels, held, false, false, true);
+
+            for (int ch = 0; ch < numChannels; ++ch)
+                tail.copyFrom (ch, 0, result, ch, toWrite, held);
+
+            result.setSize (0, 0);
+
+            if (progress != nullptr)
+                *progress = (float) written / (float) jmax ((int64) 1, length);
+        }
+
+        pool.removeAllJobs (true, 10000);
+        writer.reset();
+
+        if (error.isNotEmpty())
+            output.deleteFile();
+
+        return error;
+    }
+
+    static constexpr int blockSize = 1024;
+
+    // Returns a stretcher configured like the plugin, processing blockSize frames at a time.
+    static std::unique_ptr<te::TimeStretcher> createStretcher (const Settings& s, double sampleRate, int numChannels) {
+        auto ts = std::make_unique<te::TimeStretcher>();
+        ts->initialise (sampleRate, blockSize, numChannels, s.mode, {}, false);
+        ts->setSpeedAndPitch (1.0f, s.semitones);
+        return ts;
+    }
+
+    // Finds the stretcher's delay by pushing an impulse through it. Everything aligned with the same
+    // value stays coherent, even if it is off by a few samples.
+    static int measureLatency (const Settings& s, double sampleRate, int numChannels) {
+        auto ts = createStretcher (s, sampleRate, numChannels);
+
+        AudioBuffer<float> in (numChannels, ts->getMaxFramesNeeded()), out (numChannels, blockSize);
+        float peak = 0.0f;
+        int peakIndex = 0, produced = 0;
+        bool impulseSent = false;
+
+        while (produced < (int) sampleRate) {
+            const int needed = ts->getFramesNeeded();
+            in.clear();
+
+            if (! impulseSent && needed > 0) {
+                for (int ch = 0; ch < numChannels; ++ch)
+                    in.setSample (ch, 0, 1.0f);
+
+                impulseSent = true;
+            }
+
+            ts->processData (in.getArrayOfReadPointers(), needed, out.getArrayOfWritePointers());
+
+            for (int i = 0; i < blockSize; ++i) {
+                const float v = std::abs (out.getSample (0, i));
+
+                if (v > peak) {
+                    peak = v;
+                    peakIndex = produced + i;
+                }
+            }
+
+            produced += blockSize;
+        }
+
+        return peakIndex;
+    }
+
+private:
+    te::Engine& engine;
+    const Settings settings;
+
+    //==============================================================================
+    // Shifts one segment, producing the crossfade-weighted output for [a - halfOverlap, b + halfOverlap).
+    struct SegmentJob  : public ThreadPoolJob {
+
+        SegmentJob (ParallelPitchRenderer& r, const File& f, double rate, int channels, int64 len,
+                    int64 regionStart, int64 regionEnd, int fadeHalfLength, int preRollSamples, int latencySamples,
+                    bool shouldFadeIn, bool shouldFadeOut)
+            : ThreadPoolJob ("pitch segment"), owner (r), file (f), sampleRate (rate), numChannels (channels), length (len),
+              a (regionStart), b (regionEnd), half (fadeHalfLength), preRoll (preRollSamples), latency (latencySamples),
+              fadesIn (shouldFadeIn), fadesOut (shouldFadeOut) {
+        }
+
+        JobStatus runJob() override {
+            ThreadPolicy::applyToBackgroundThread();
+            error = process();
+            finished.signal();
+            return jobHasFinished;
+        }
+
+        ParallelPitchRenderer& owner;
+        const File file;
+        const double sampleRate;
+        const int numChannels;
+        const int64 length, a, b;
+        const int half, preRoll, latency;
+        const bool fadesIn, fadesOut;
+
+        AudioBuffer<float> result;
+        String error;
+        WaitableEvent finished { true };
+
+    private:
+        String process() {
+            std::unique_ptr<AudioFormatReader> reader (owner.engine.getAudioFileFormatManager().readFormatManager.createReaderFor (file));
+
+            if (reader == nullptr)
+                return TRANS("Couldn't read") + " " + file.getFileName();
+
+            const int64 start = fadesIn ? a - half : a;
+            const int64 end = fadesOut ? jmin (length, b + half) : b;
+            const int64 inputStart = jmax ((int64) 0, start - preRoll);
+
+            auto ts = createStretcher (owner.settings, sampleRate, numChannels);
+            AudioBuffer<float> in (numChannels, ts->getMaxFramesNeeded()), out (numChannels, blockSize);
+            result.setSize (numChannels, (int) (end - start));
+            result.clear();
+
+            // Output sample k of the stretcher corresponds to input sample inputStart + k - latency.
+            int64 readPos = inputStart, produced = 0;
+            const int64 firstWanted = start - inputStart + latency, lastWanted = end - inputStart + latency;
+
+            while (produced < lastWanted) {
+                if (shouldExit())
+                    return TRANS("Cancelled");
+
+                const int needed = ts->getFramesNeeded();
+                in.clear();
+
+                // Past the end of the file the stretcher is fed silence, just as the serial render would be.
+                if (readPos < length)
+                    reader->read (&in, 0, (int) jmin ((int64) needed, length - readPos), readPos, true, true);
+
+                readPos += needed;
+                ts->processData (in.getArrayOfReadPointers(), needed, out.getArrayOfWritePointers());
+
+                const int64 from = jmax (produced, firstWanted), to = jmin (produced + blockSize, lastWanted);
+
+                for (int ch = 0; ch < numChannels && from < to; ++ch)
+                    result.copyFrom (ch, (int) (from - firstWanted), out, ch, (int) (from - produced), (int) (to - from));
+
+                produced += blockSize;
+            }
+
+            applyCrossfadeWeights();
+            return {};
+        }
+
+        // Ramps the overlapping ends so that neighbouring segments sum to unity.
+        void applyCrossfadeWeights() {
+            const int fade = jmin (2 * half, result.getNumSamples());
+
+            if (fadesIn)
+                result.applyGainRamp (0, fade, 0.0f, 1.0f);
+
+            if (fadesOut)
+                result.applyGainRamp (result.getNumSamples() - fade, fade, 1.0f, 0.0f);
+        }
+    };
+};
+//==============================================================================
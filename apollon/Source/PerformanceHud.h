@@ -0,0 +1,149 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "Tracing.h"
+#include "EffectsChain.h"
+#include "LiveInput.h"
+#include "ThreadPolicy.h"
+
+namespace te = tracktion_engine;
+
+//==============================================================================
+/**
+        Timings of the UI thread, fed by the components being measured and read by the HUD.
+        Everything here is touched only on the message thread.
+*/
+//==============================================================================
+struct UiTimings {
+
+    // Smoothed milliseconds for each measurement.
+    double frameMs = 0.0, paintMs = 0.0, rotarySliderMs = 0.0;
+
+    // Milliseconds accumulated during the frame in progress.
+    double framePaintMs = 0.0, frameRotaryMs = 0.0;
+
+    static UiTimings& get() {
+        static UiTimings timings;
+        return timings;
+    }
+
+    // Folds the frame that just finished into the smoothed values.
+    void endFrame (double totalMs) {
+        frameMs = smooth (frameMs, totalMs);
+        paintMs = smooth (paintMs, framePaintMs);
+        rotarySliderMs = smooth (rotarySliderMs, frameRotaryMs);
+        framePaintMs = frameRotaryMs = 0.0;
+    }
+
+    // Adds the time from construction to destruction onto one of the per-frame accumulators.
+    struct ScopedTimer {
+        explicit ScopedTimer (double& target) : accumulator (target) {}
+        ~ScopedTimer() { accumulator += (Time::getMillisecondCounterHiRes() - start); }
+
+        double& accumulator;
+        const double start = Time::getMillisecondCounterHiRes();
+    };
+
+private:
+    static double smooth (double current, double latest) {
+        return current + 0.2 * (latest - current);
+    }
+};
+//==============================================================================
+/**
+    Toggleable overlay for checking how close a machine is to the edge: UI frame and paint time,
+    time spent drawing the rotary slider, audio callback load, xruns and the stretcher's latency.
+    Audio-side values come from atomics published by the callback, so sampling them never blocks it.
+*/
+//==============================================================================
+struct PerformanceHud    : public Component,
+                           private Timer {
+
+    PerformanceHud() {
+        setInterceptsMouseClicks (false, false);
+    }
+
+    // Sets where the audio-side values are read from. Any of them may be nullptr.
+    void setSources (te::Engine* e, Tracing::CallbackZone* callback, te::Plugin* stretcher, EffectsChainPlugin* chain) {
+        engine = e;
+        callbackMonitor = callback;
+        pitchShifter = stretcher;
+        effects = chain;
+    }
+
+    // Shows or hides the overlay, it only samples while it's visible.
+    void toggle() {
+        setVisible (! isVisible());
+
+        if (isVisible()) {
+            toFront (false);
+            startTimerHz (4);
+        }
+        else {
+            stopTimer();
+        }
+    }
+
+    void paint (Graphics& g) override {
+        auto area = getLocalBounds().reduced (6).removeFromTop (lines.size() * 14 + 8);
+
+        g.setColour (juce::Colours::black.withAlpha (0.7f));
+        g.fillRoundedRectangle (area.toFloat(), 6.0f);
+
+        g.setColour (juce::Colours::white);
+        g.setFont (Font (Font::getDefaultMonospacedFontName(), 12.0f, Font::plain));
+
+        auto text = area.reduced (6, 4);
+
+        for (auto& line : lines)
+            g.drawText (line, text.removeFromTop (14), Justification::centredLeft);
+    }
+
+private:
+    te::Engine* engine = nullptr;
+    Tracing::CallbackZone* callbackMonitor = nullptr;
+    te::Plugin* pitchShifter = nullptr;
+    EffectsChainPlugin* effects = nullptr;
+    StringArray lines;
+
+    void timerCallback() override {
+        auto& ui = UiTimings::get();
+        lines.clearQuick();
+
+        lines.add ("frame    " + String (ui.frameMs, 2) + " ms");
+        lines.add ("paint    " + String (ui.paintMs, 2) + " ms");
+        lines.add ("rotary   " + String (ui.rotarySliderMs, 2) + " ms");
+
+        if (callbackMonitor != nullptr)
+            lines.add ("callback " + String (roundToInt (callbackMonitor->getLoad() * 100.0f)) + "% (peak "
+                         + String (roundToInt (callbackMonitor->getAndResetPeakLoad() * 100.0f)) + "%)");
+
+        if (engine != nullptr)
+            lines.add ("xruns    " + String (engine->getDeviceManager().deviceManager.getXRunCount()));
+
+        if (pitchShifter != nullptr)
+            lines.add ("latency  " + String (pitchShifter->getLatencySeconds() * 1000.0, 1) + " ms");
+
+        // From input to output through the device and every plugin, what a live performer hears.
+        if (engine != nullptr && pitchShifter != nullptr) {
+            const auto processing = pitchShifter->getLatencySeconds() + (effects != nullptr ? effects->getLatencySeconds() : 0.0);
+            lines.add ("e2e      " + String (LiveInput::getEndToEndLatencySeconds (*engine, processing) * 1000.0, 1) + " ms");
+        }
+
+        if (ThreadPolicy::isSupported() && ThreadPolicy::generation.load() > 0)
+            lines.add ("threads  " + ThreadPolicy::getReport());
+
+        // One line per effect, with what it costs each block.
+        if (effects != nullptr) {
+            for (int i = 0; i < effects->getNumEffects(); ++i) {
+                const auto fx = effects->getEffectInfo (i);
+                lines.add ("fx " + String (i + 1) + "     " + String (roundToInt (fx.microsPerBlock)) + " us ("
+                             + String (roundToInt (fx.load * 100.0f)) + "%) " + fx.name
+                             + (fx.autoBypassed ? " [over budget]" : fx.bypassed ? " [bypassed]" : ""));
+            }
+        }
+
+        repaint();
+    }
+};
+//==============================================================================
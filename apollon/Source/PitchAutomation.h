@@ -0,0 +1,382 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+namespace te = tracktion_engine;
+
+//==============================================================================
+/**
+    A transposition that changes over the edit, drawn on a lane over the waveform or recorded
+    from the pitch slider during playback.
+
+    The points live in the pitch shifter's state, so they are saved with the session and edits to
+    them can be undone. The audio thread never walks them: whenever they change, the curve is
+    sampled every tableStep seconds into a table, and each block reads its value from that table
+    with one interpolation however many points there are. A song full of key changes costs the
+    same per block as a static shift.
+
+    While the slider is held the curve is ignored. When recording, the points the touch passes
+    over are replaced by what the slider did, and the curve picks up again at its next point once
+    the slider is let go.
+*/
+//==============================================================================
+class PitchCurve  : private ValueTree::Listener {
+public:
+
+    struct Point {
+        double time;
+        float semitones;
+    };
+
+    static constexpr double tableStep = 0.005;
+    static constexpr double maxSeconds = 4.0 * 60.0 * 60.0;
+
+    // Recorded points closer together than this are dropped, the table couldn't tell them apart anyway.
+    static constexpr double minRecordInterval = 0.02;
+
+    PitchCurve (ValueTree pluginState, UndoManager* um)
+        : undoManager (um) {
+        state = pluginState.getOrCreateChildWithName ("PITCHCURVE", nullptr);
+        state.addListener (this);
+        wasEmpty = isEmpty();
+        rebuildTable();
+    }
+
+    ~PitchCurve() override {
+        state.removeListener (this);
+    }
+
+    // Called on the message thread whenever the points change, to redraw the lane.
+    std::function<void()> onChange;
+
+    // Called on the message thread when the curve gains its first point or loses its last.
+    std::function<void()> onEmptyChanged;
+
+    bool isEmpty() const {
+        return state.getNumChildren() == 0;
+    }
+
+    // Returns the points in time order.
+    Array<Point> getPoints() const {
+        Array<Point> points;
+
+        for (auto p : state)
+            points.add ({ (double) p["time"], (float) p["semitones"] });
+
+        return points;
+    }
+
+    // Returns the transposition at the given time, linear between points and held beyond the first and last.
+    static float getValueAt (const Array<Point>& points, double time) {
+        const auto next = std::upper_bound (points.begin(), points.end(), time, [] (double t, const Point& p) { return t < p.time; });
+        return interpolate (points, (int) (next - points.begin()), time);
+    }
+
+    void beginTransaction (const String& name) {
+        if (undoManager != nullptr)
+            undoManager->beginNewTransaction (name);
+    }
+
+    // Adds a point after any others at the same time, and returns its index.
+    int addPoint (double time, float semitones) {
+        time = jlimit (0.0, maxSeconds, time);
+        int index = 0;
+
+        while (index < state.getNumChildren() && (double) state.getChild (index)["time"] <= time)
+            ++index;
+
+        ValueTree point ("POINT");
+        point.setProperty ("time", time, nullptr);
+        point.setProperty ("semitones", semitones, nullptr);
+        state.addChild (point, index, undoManager);
+
+        return index;
+    }
+
+    // Moves a point, keeping it between its neighbours so the order never changes.
+    void movePoint (int index, double time, float semitones) {
+        auto point = state.getChild (index);
+
+        if (! point.isValid())
+            return;
+
+        const double earliest = index > 0 ? (double) state.getChild (index - 1)["time"] : 0.0;
+        const double latest = index < state.getNumChildren() - 1 ? (double) state.getChild (index + 1)["time"] : maxSeconds;
+
+        point.setProperty ("time", jlimit (earliest, latest, time), undoManager);
+        point.setProperty ("semitones", semitones, undoManager);
+    }
+
+    void removePoint (int index) {
+        state.removeChild (index, undoManager);
+    }
+
+    void clear() {
+        state.removeAllChildren (undoManager);
+    }
+
+    //==============================================================================
+    // Holds the curve off until endTouch(), and if record is true starts replacing it with what touch() is given.
+    void beginTouch (bool record) {
+        touched = true;
+        recording = record;
+        lastRecordTime = -1.0;
+
+        if (record)
+            beginTransaction ("Record Pitch");
+    }
+
+    // Records the slider's value at the given edit time, if the touch is recording.
+    void touch (double time, float semitones) {
+        if (! recording)
+            return;
+
+        // The transport jumping backwards is a loop wrap, so recording carries on from the loop start.
+        const bool continuing = lastRecordTime >= 0.0 && time >= lastRecordTime;
+
+        if (continuing && time - lastRecordTime < minRecordInterval)
+            return;
+
+        if (continuing) {
+            removePointsBetween (lastRecordTime, time);
+        }
+        else {
+            // Step from what the curve held up to here, so everything before the touch is untouched.
+            addPoint (time, getValueAt (getPoints(), time));
+        }
+
+        addPoint (time, semitones);
+        lastRecordTime = time;
+    }
+
+    void endTouch() {
+        const bool wasRecording = recording;
+        recording = false;
+        touched = false;
+
+        // The table isn't rebuilt for every recorded point, nothing reads it during a touch.
+        if (wasRecording)
+            rebuildTable();
+    }
+
+    // Returns true while the slider is held, the audio thread leaves the transposition alone until it's let go.
+    bool isTouched() const noexcept {
+        return touched.load();
+    }
+
+    // Sets semitones to the curve's value at the given edit time. Returns false if there is no curve
+    // to follow, or the table is being replaced right now. Called on the audio thread.
+    bool lookup (double time, float& semitones) noexcept {
+        const SpinLock::ScopedTryLockType sl (tableLock);
+
+        if (! sl.isLocked() || table.empty())
+            return false;
+
+        const double position = jmax (0.0, time) / tableStep;
+        const auto index = (size_t) position;
+
+        if (index + 1 >= table.size()) {
+            semitones = table.back();
+            return true;
+        }
+
+        const auto frac = (float) (position - (double) index);
+        semitones = table[index] + frac * (table[index + 1] - table[index]);
+        return true;
+    }
+
+private:
+    ValueTree state;
+    UndoManager* undoManager;
+
+    SpinLock tableLock;
+    std::vector<float> table;
+
+    std::atomic<bool> touched { false };
+    bool recording = false, wasEmpty = true;
+    double lastRecordTime = -1.0;
+
+    // Interpolates at the given time, where next is the index of the first point after it.
+    static float interpolate (const Array<Point>& points, int next, double time) {
+        if (points.isEmpty())
+            return 0.0f;
+
+        if (next <= 0)
+            return points.getFirst().semitones;
+
+        if (next >= points.size())
+            return points.getLast().semitones;
+
+        const auto& a = points.getReference (next - 1);
+        const auto& b = points.getReference (next);
+        const auto proportion = b.time > a.time ? (float) ((time - a.time) / (b.time - a.time)) : 1.0f;
+
+        return a.semitones + proportion * (b.semitones - a.semitones);
+    }
+
+    // Removes the points after start, up to and including end.
+    void removePointsBetween (double start, double end) {
+        for (int i = state.getNumChildren(); --i >= 0;) {
+            const double t = state.getChild (i)["time"];
+
+            if (t > start && t <= end)
+                state.removeChild (i, undoManager);
+        }
+    }
+
+    // Samples the curve into a new table, up to its last point, and swaps it in for the audio thread.
+    void rebuildTable() {
+        const auto points = getPoints();
+        std::vector<float> newTable;
+
+        if (! points.isEmpty()) {
+            newTable.resize ((size_t) std::ceil (jmin (points.getLast().time, maxSeconds) / tableStep) + 2);
+            int next = 0;
+
+            for (size_t i = 0; i < newTable.size(); ++i) {
+                const double t = (double) i * tableStep;
+
+                while (next < points.size() && points.getReference (next).time <= t)
+                    ++next;
+
+                newTable[i] = interpolate (points, next, t);
+            }
+        }
+
+        {
+            const SpinLock::ScopedLockType sl (tableLock);
+            table.swap (newTable);
+        }
+
+        // The old table is freed here, on the message thread.
+    }
+
+    void curveChanged() {
+        if (! recording)
+            rebuildTable();
+
+        if (onChange != nullptr)
+            onChange();
+
+        if (isEmpty() != wasEmpty) {
+            wasEmpty = isEmpty();
+
+            if (onEmptyChanged != nullptr)
+                onEmptyChanged();
+        }
+    }
+
+    void valueTreePropertyChanged (ValueTree&, const Identifier&) override     { curveChanged(); }
+    void valueTreeChildAdded (ValueTree&, ValueTree&) override                  { curveChanged(); }
+    void valueTreeChildRemoved (ValueTree&, ValueTree&, int) override           { curveChanged(); }
+
+    JUCE_DECLARE_NON_COPYABLE (PitchCurve)
+};
+
+//==============================================================================
+/**
+    Draws a PitchCurve over the waveform and lets its points be edited.
+
+    Clicking the line adds a point, dragging a point moves it and double-clicking one removes it.
+    Clicks anywhere else fall through to the waveform underneath, so seeking still works with the
+    lane shown. Time maps across the width the same way the Thumbnail maps it.
+*/
+//==============================================================================
+class PitchAutomationLane  : public Component {
+public:
+
+    PitchAutomationLane (PitchCurve& c, te::TransportControl& tc, Range<float> displayRange)
+        : curve (c), transport (tc), range (displayRange) {
+        curve.onChange = [this] { repaint(); };
+    }
+
+    ~PitchAutomationLane() override {
+        curve.onChange = nullptr;
+    }
+
+    void paint (Graphics& g) override {
+        const auto points = curve.getPoints();
+        const auto area = getArea();
+
+        g.setColour (Colours::orange.withAlpha (0.3f));
+        g.drawHorizontalLine (roundToInt (toY (0.0f)), area.getX(), area.getRight());
+
+        Path line;
+
+        for (float x = area.getX(); x <= area.getRight(); x += 2.0f) {
+            const float y = toY (PitchCurve::getValueAt (points, toTime (x)));
+            x == area.getX() ? line.startNewSubPath (x, y) : line.lineTo (x, y);
+        }
+
+        g.setColour (Colours::orange);
+        g.strokePath (line, PathStrokeType (2.0f));
+
+        for (auto& p : points)
+            g.fillEllipse (Rectangle<float> (pointSize, pointSize).withCentre ({ toX (p.time), toY (p.semitones) }));
+    }
+
+    bool hitTest (int x, int y) override {
+        return findPoint ({ (float) x, (float) y }) >= 0
+                 || std::abs ((float) y - toY (PitchCurve::getValueAt (curve.getPoints(), toTime ((float) x)))) < grabDistance;
+    }
+
+    void mouseDown (const MouseEvent& e) override {
+        curve.beginTransaction ("Edit Pitch");
+        dragged = findPoint (e.position);
+
+        if (dragged < 0)
+            dragged = curve.addPoint (toTime (e.position.x), toSemitones (e.position.y));
+    }
+
+    void mouseDrag (const MouseEvent& e) override {
+        if (dragged >= 0)
+            curve.movePoint (dragged, toTime (e.position.x), toSemitones (e.position.y));
+    }
+
+    void mouseUp (const MouseEvent&) override {
+        dragged = -1;
+    }
+
+    void mouseDoubleClick (const MouseEvent& e) override {
+        const int index = findPoint (e.position);
+
+        if (index >= 0)
+            curve.removePoint (index);
+    }
+
+private:
+    PitchCurve& curve;
+    te::TransportControl& transport;
+    Range<float> range;
+    int dragged = -1;
+
+    static constexpr float pointSize = 8.0f, grabDistance = 6.0f;
+
+    // The same area the Thumbnail draws its waveform in.
+    Rectangle<float> getArea() const {
+        return getLocalBounds().reduced (0, 10).toFloat();
+    }
+
+    double getLength() const {
+        return jmax (0.001, transport.getLoopRange().getLength());
+    }
+
+    float toX (double time) const          { return getArea().getX() + getArea().getWidth() * (float) (time / getLength()); }
+    double toTime (float x) const          { return jmax (0.0, (x - getArea().getX()) / jmax (1.0f, getArea().getWidth()) * getLength()); }
+    float toY (float semitones) const      { return jmap (range.clipValue (semitones), range.getStart(), range.getEnd(), getArea().getBottom(), getArea().getY()); }
+    float toSemitones (float y) const      { return range.clipValue (jmap (y, getArea().getBottom(), getArea().getY(), range.getStart(), range.getEnd())); }
+
+    // Returns the index of the point under the position, or -1 if there isn't one.
+    int findPoint (Point<float> position) const {
+        const auto points = curve.getPoints();
+
+        for (int i = points.size(); --i >= 0;)
+            if (position.getDistanceFrom ({ toX (points[i].time), toY (points[i].semitones) }) < grabDistance)
+                return i;
+
+        return -1;
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (PitchAutomationLane)
+};
+//==============================================================================
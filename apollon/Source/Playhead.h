@@ -0,0 +1,72 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+//==============================================================================
+/**
+    Edit position published by the audio thread once per block, stamped with when it was taken.
+
+    The fields are written under a sequence counter, so the audio thread never waits and the UI
+    retries on the rare occasion it reads in the middle of a write. From a snapshot the UI can
+    extrapolate where playback is at any moment, instead of polling the transport and seeing a
+    position that jumps once per timer tick.
+*/
+//==============================================================================
+struct PlayheadClock {
+
+    struct Snapshot {
+        double position = 0.0;  // Edit time at the start of the block, in seconds.
+        int64 ticks = 0;        // High-resolution ticks when it was published.
+        bool playing = false;
+    };
+
+    // Called on the audio thread at the start of each block.
+    void publish (double position, bool playing) noexcept {
+        const auto s = sequence.load (std::memory_order_relaxed);
+        sequence.store (s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence (std::memory_order_release);
+
+        publishedPosition.store (position, std::memory_order_relaxed);
+        publishedTicks.store (Time::getHighResolutionTicks(), std::memory_order_relaxed);
+        publishedPlaying.store (playing, std::memory_order_relaxed);
+
+        sequence.store (s + 2, std::memory_order_release);
+    }
+
+    // Returns a consistent copy of the last published values. Never blocks the audio thread.
+    Snapshot read() const noexcept {
+        Snapshot snapshot;
+        uint32 before, after;
+
+        do {
+            before = sequence.load (std::memory_order_acquire);
+            snapshot.position = publishedPosition.load (std::memory_order_relaxed);
+            snapshot.ticks = publishedTicks.load (std::memory_order_relaxed);
+            snapshot.playing = publishedPlaying.load (std::memory_order_relaxed);
+            std::atomic_thread_fence (std::memory_order_acquire);
+            after = sequence.load (std::memory_order_relaxed);
+        }
+        while (before != after || (before & 1) != 0);
+
+        return snapshot;
+    }
+
+    // Returns where the published position has got to by now, or nullopt if playback isn't running.
+    // Stops extrapolating if no block has arrived for a while, e.g. when the device has gone away.
+    std::optional<double> getCurrentPosition() const noexcept {
+        const auto snapshot = read();
+
+        if (! snapshot.playing || snapshot.ticks == 0)
+            return {};
+
+        const auto elapsed = Time::highResolutionTicksToSeconds (Time::getHighResolutionTicks() - snapshot.ticks);
+        return snapshot.position + jlimit (0.0, 0.1, elapsed);
+    }
+
+private:
+    std::atomic<uint32> sequence { 0 };
+    std::atomic<double> publishedPosition { 0.0 };
+    std::atomic<int64> publishedTicks { 0 };
+    std::atomic<bool> publishedPlaying { false };
+};
+//==============================================================================
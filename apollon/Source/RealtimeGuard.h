@@ -0,0 +1,285 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+#if JUCE_LINUX || JUCE_MAC
+ #include <execinfo.h>
+#endif
+
+// The guard replaces the global allocator, so it's only compiled in when asked for with APOLLON_RT_GUARD=1.
+#ifndef APOLLON_RT_GUARD
+ #define APOLLON_RT_GUARD 0
+#endif
+
+//==============================================================================
+/**
+    Real-time-safety guard.
+
+    Code running on behalf of the audio thread is wrapped in a ScopedAudioThread. While one is
+    alive, every allocation, deallocation, mutex lock or sleep made on that thread is recorded
+    with its stack into a fixed-size log, without allocating. A timer on the message thread then
+    symbolises the stacks and logs each distinct violation once. Offline renders run the same
+    code on worker threads with no deadline, so they aren't marked, except in the regression run,
+    which fails on any violation its renders record.
+
+    The hooks themselves (operator new/delete and, on Linux, the pthread/sleep symbols) are
+    defined in exactly one translation unit, the one that defines APOLLON_RT_GUARD_IMPLEMENTATION
+    before including this file.
+*/
+//==============================================================================
+namespace RealtimeGuard {
+
+    struct Violation {
+        const char* what;
+        int numFrames;
+        void* frames[24];
+    };
+
+    static constexpr int logSize = 256;
+
+    inline Violation violationLog[logSize];
+    inline std::atomic<int> numViolations { 0 };
+
+    inline thread_local int audioThreadDepth = 0;
+    inline thread_local bool inHook = false;
+
+    // Set by the regression run, whose offline renders drive the same processing code the device callback does.
+    inline std::atomic<bool> guardRenders { false };
+
+    // Returns true if the guard is compiled in.
+    constexpr bool isActive() noexcept {
+        return APOLLON_RT_GUARD != 0;
+    }
+
+    // Records a violation if the calling thread is currently doing audio work.
+    inline void check (const char* what) noexcept {
+       #if APOLLON_RT_GUARD
+        if (audioThreadDepth == 0 || inHook)
+            return;
+
+        inHook = true;
+        const int index = numViolations.fetch_add (1, std::memory_order_relaxed);
+
+        if (index < logSize) {
+            auto& v = violationLog[index];
+            v.what = what;
+
+           #if JUCE_LINUX || JUCE_MAC
+            v.numFrames = backtrace (v.frames, (int) std::size (v.frames));
+           #else
+            v.numFrames = 0;
+           #endif
+        }
+
+        inHook = false;
+       #else
+        ignoreUnused (what);
+       #endif
+    }
+
+    // Marks the enclosing scope as audio-thread work, unless isAudioThread is false and renders aren't
+    // being guarded. Nests, so plugins can mark themselves inside the device callback.
+    struct ScopedAudioThread {
+        explicit ScopedAudioThread (bool isAudioThread = true) noexcept
+            : marked (isActive() && (isAudioThread || guardRenders.load (std::memory_order_relaxed))) {
+            if (marked)
+                ++audioThreadDepth;
+        }
+
+        ~ScopedAudioThread() noexcept {
+            if (marked)
+                --audioThreadDepth;
+        }
+
+        const bool marked;
+
+        JUCE_DECLARE_NON_COPYABLE (ScopedAudioThread)
+    };
+
+    //==============================================================================
+    // Logs each distinct violation once, with its symbolised stack.
+    class Reporter  : private Timer {
+    public:
+        Reporter() {
+           #if JUCE_LINUX || JUCE_MAC
+            // backtrace() loads its unwinder lazily, do that now rather than inside the first hook.
+            void* warmUp[4];
+            backtrace (warmUp, 4);
+           #endif
+
+            startTimer (500);
+        }
+
+        ~Reporter() override {
+            timerCallback();
+        }
+
+        // Returns the number of violations recorded so far.
+        static int getNumViolations() noexcept {
+            return numViolations.load();
+        }
+
+    private:
+        int reported = 0;
+        std::set<String> seen;
+
+        void timerCallback() override {
+            const int available = jmin (numViolations.load(), logSize);
+
+            for (; reported < available; ++reported) {
+                auto& v = violationLog[reported];
+                String stack;
+
+               #if JUCE_LINUX || JUCE_MAC
+                if (auto symbols = backtrace_symbols (v.frames, v.numFrames)) {
+                    // Skip the frames of the hook itself.
+                    for (int i = 2; i < v.numFrames; ++i)
+                        stack << "    " << symbols[i] << newLine;
+
+                    std::free (symbols);
+                }
+               #endif
+
+                if (seen.insert (String (v.what) + stack).second)
+                    Logger::writeToLog ("[rt-guard] " + String (v.what) + " on the audio thread" + newLine + stack);
+            }
+
+            if (numViolations.load() > logSize && reported == logSize) {
+                Logger::writeToLog ("[rt-guard] log full, further violations are counted but not recorded");
+                ++reported;
+            }
+        }
+    };
+}
+//==============================================================================
+#if APOLLON_RT_GUARD && defined (APOLLON_RT_GUARD_IMPLEMENTATION)
+
+ namespace RealtimeGuard {
+     // Allocates for the aligned operator new overloads, which can't share plain malloc/free.
+     inline void* alignedAlloc (std::size_t size, std::align_val_t alignment) noexcept {
+         const auto align = jmax ((std::size_t) alignment, sizeof (void*));
+
+        #if JUCE_WINDOWS
+         return _aligned_malloc (size > 0 ? size : 1, align);
+        #else
+         void* p = nullptr;
+         return posix_memalign (&p, align, size > 0 ? size : 1) == 0 ? p : nullptr;
+        #endif
+     }
+
+     inline void alignedFree (void* p) noexcept {
+        #if JUCE_WINDOWS
+         _aligned_free (p);
+        #else
+         std::free (p);
+        #endif
+     }
+ }
+
+ void* operator new (std::size_t size) {
+     RealtimeGuard::check ("allocation");
+
+     if (auto* p = std::malloc (size > 0 ? size : 1))
+         return p;
+
+     throw std::bad_alloc();
+ }
+
+ void* operator new[] (std::size_t size)                          { return operator new (size); }
+ void* operator new (std::size_t size, const std::nothrow_t&) noexcept   { RealtimeGuard::check ("allocation"); return std::malloc (size > 0 ? size : 1); }
+ void* operator new[] (std::size_t size, const std::nothrow_t&) noexcept { RealtimeGuard::check ("allocation"); return std::malloc (size > 0 ? size : 1); }
+
+ void operator delete (void* p) noexcept                          { if (p != nullptr) RealtimeGuard::check ("deallocation"); std::free (p); }
+ void operator delete[] (void* p) noexcept                        { operator delete (p); }
+ void operator delete (void* p, std::size_t) noexcept             { operator delete (p); }
+ void operator delete[] (void* p, std::size_t) noexcept           { operator delete (p); }
+
+ void* operator new (std::size_t size, std::align_val_t align) {
+     RealtimeGuard::check ("allocation");
+
+     if (auto* p = RealtimeGuard::alignedAlloc (size, align))
+         return p;
+
+     throw std::bad_alloc();
+ }
+
+ void* operator new[] (std::size_t size, std::align_val_t align)                                   { return operator new (size, align); }
+ void* operator new (std::size_t size, std::align_val_t align, const std::nothrow_t&) noexcept     { RealtimeGuard::check ("allocation"); return RealtimeGuard::alignedAlloc (size, align); }
+ void* operator new[] (std::size_t size, std::align_val_t align, const std::nothrow_t&) noexcept   { RealtimeGuard::check ("allocation"); return RealtimeGuard::alignedAlloc (size, align); }
+
+ void operator delete (void* p, std::align_val_t) noexcept                 { if (p != nullptr) RealtimeGuard::check ("deallocation"); RealtimeGuard::alignedFree (p); }
+ void operator delete[] (void* p, std::align_val_t align) noexcept         { operator delete (p, align); }
+ void operator delete (void* p, std::size_t, std::align_val_t align) noexcept     { operator delete (p, align); }
+ void operator delete[] (void* p, std::size_t, std::align_val_t align) noexcept   { operator delete (p, align); }
+ void operator delete (void* p, const std::nothrow_t&) noexcept                   { operator delete (p); }
+ void operator delete[] (void* p, const std::nothrow_t&) noexcept                 { operator delete (p); }
+ void operator delete (void* p, std::align_val_t align, const std::nothrow_t&) noexcept     { operator delete (p, align); }
+ void operator delete[] (void* p, std::align_val_t align, const std::nothrow_t&) noexcept   { operator delete (p, align); }
+
+ #if JUCE_LINUX
+  #include <dlfcn.h>
+  #include <sched.h>
+
+  namespace RealtimeGuard {
+      inline int (*realMutexLock) (pthread_mutex_t*) = nullptr;
+      inline int (*realNanosleep) (const struct timespec*, struct timespec*) = nullptr;
+      inline int (*realUsleep) (useconds_t) = nullptr;
+
+      // Looks up the real symbols once, at load time and so before any audio thread starts. Looking
+      // them up lazily inside the hooks could recurse, dlsym locks a mutex of its own.
+      __attribute__ ((constructor (101))) static void resolveRealSymbols() {
+          realMutexLock = reinterpret_cast<int (*) (pthread_mutex_t*)> (dlsym (RTLD_NEXT, "pthread_mutex_lock"));
+          realNanosleep = reinterpret_cast<int (*) (const struct timespec*, struct timespec*)> (dlsym (RTLD_NEXT, "nanosleep"));
+          realUsleep = reinterpret_cast<int (*) (useconds_t)> (dlsym (RTLD_NEXT, "usleep"));
+      }
+
+      // Stand-ins built from functions that aren't hooked, for calls made before the lookup, such as
+      // from other libraries' constructors. Nothing is recorded that early, no audio thread exists yet.
+      inline int lockWithoutLookup (pthread_mutex_t* m) {
+          int result;
+
+          while ((result = pthread_mutex_trylock (m)) == EBUSY)
+              sched_yield();
+
+          return result;
+      }
+
+      inline int sleepWithoutLookup (const struct timespec* t, struct timespec* r) {
+          if (const int error = clock_nanosleep (CLOCK_REALTIME, 0, t, r)) {
+              errno = error;
+              return -1;
+          }
+
+          return 0;
+      }
+  }
+
+  extern "C" int pthread_mutex_lock (pthread_mutex_t* m) {
+      if (RealtimeGuard::realMutexLock == nullptr)
+          return RealtimeGuard::lockWithoutLookup (m);
+
+      RealtimeGuard::check ("mutex lock");
+      return RealtimeGuard::realMutexLock (m);
+  }
+
+  extern "C" int nanosleep (const struct timespec* t, struct timespec* r) {
+      if (RealtimeGuard::realNanosleep == nullptr)
+          return RealtimeGuard::sleepWithoutLookup (t, r);
+
+      RealtimeGuard::check ("sleep");
+      return RealtimeGuard::realNanosleep (t, r);
+  }
+
+  extern "C" int usleep (useconds_t u) {
+      if (RealtimeGuard::realUsleep == nullptr) {
+          const struct timespec t { (time_t) (u / 1000000), (long) (u % 1000000) * 1000 };
+          return RealtimeGuard::sleepWithoutLookup (&t, nullptr);
+      }
+
+      RealtimeGuard::check ("sleep");
+      return RealtimeGuard::realUsleep (u);
+  }
+ #endif
+
+#endif
+//==============================================================================
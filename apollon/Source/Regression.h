@@ -0,0 +1,447 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "Utilities.h"
+#include "ApollonPitchShiftPlugin.h"
+#include "Export.h"
+#include "LargeFile.h"
+#include "Batch.h"
+
+#if JUCE_LINUX
+ #include <unistd.h>
+#elif JUCE_MAC
+ #include <mach/mach.h>
+#endif
+
+namespace te = tracktion_engine;
+
+//==============================================================================
+/**
+    Golden-audio regression and throughput check for the pitch chain, run with
+        apollon --regression <folder> [--update] [--long]
+
+    Every file in <folder>/inputs is rendered through the same chain MainComponent builds
+    (a wave clip with auto-tempo and auto-pitch off, then the pitch shifter) at each of the
+    transpositions below. Each result is compared against <folder>/golden by spectrum, and its
+    realtime factor against the baseline stored in <folder>/throughput.xml. --update rewrites
+    the goldens and the baseline instead of checking them.
+
+    One input is also sent through a real batch worker process, see runBatchCase().
+    --long adds the large-file case, see runLongInputCase().
+
+    If <folder>/inputs holds no audio, a small reference set is synthesised into it first: a
+    harmonic tone, a sweep and a run of plucked notes with noisy attacks. They come from fixed
+    seeds, so every machine renders the same samples and they never need to be checked in. The
+    goldens and the baseline do depend on the build and the machine, so record them once with
+    --update on a build whose output has been listened to, and keep that folder with the machine
+    that checks against it.
+*/
+//==============================================================================
+class RegressionRunner {
+public:
+
+    static constexpr float semitoneCases[] = { -4.0f, -1.0f, 0.0f, 3.0f };
+
+    float spectralToleranceDb = 1.5f;  // Largest mean per-bin difference, in dB, allowed against a golden.
+    float throughputTolerance = 0.2f;  // Largest fractional drop in realtime factor allowed against the baseline.
+
+    RegressionRunner (te::Engine& e, const File& folder, bool shouldUpdate)
+        : engine (e), root (folder), update (shouldUpdate) {
+    }
+
+    // Runs every case, printing a line per case. Returns the number of failures.
+    int run() {
+        auto inputFolder = root.getChildFile ("inputs");
+        auto inputs = findInputs (inputFolder);
+
+        if (inputs.isEmpty()) {
+            if (! writeReferenceInputs (inputFolder)) {
+                log ("Couldn't write the reference inputs to " + inputFolder.getFullPathName());
+                return 1;
+            }
+
+            log ("Wrote the reference inputs to " + inputFolder.getFullPathName());
+            inputs = findInputs (inputFolder);
+        }
+
+        if (inputs.isEmpty()) {
+            log ("No inputs found in " + root.getChildFile ("inputs").getFullPathName());
+            return 1;
+        }
+
+        auto goldenFolder = root.getChildFile ("golden");
+        goldenFolder.createDirectory();
+
+        auto baselineFile = root.getChildFile ("throughput.xml");
+        auto baseline = parseXML (baselineFile);
+        XmlElement newBaseline ("THROUGHPUT");
+        int failures = 0;
+
+        for (auto& input : inputs) {
+            for (auto semitones : semitoneCases) {
+                const String name = input.getFileNameWithoutExtension() + "_" + String (semitones, 1) + "st";
+                auto golden = goldenFolder.getChildFile (name + ".wav");
+                auto result = File::createTempFile (".wav");
+
+                double realtimeFactor = 0.0;
+                const auto error = renderCase (input, semitones, result, realtimeFactor);
+
+                if (error.isNotEmpty()) {
+                    log ("FAIL " + name + ": " + error);
+                    ++failures;
+                    continue;
+                }
+
+                auto* baselineCase = newBaseline.createNewChildElement ("CASE");
+                baselineCase->setAttribute ("name", name);
+                baselineCase->setAttribute ("realtimeFactor", realtimeFactor);
+
+                if (update) {
+                    golden.deleteFile();
+                    result.moveFileTo (golden);
+                    log ("UPDATED " + name + " (" + String (realtimeFactor, 1) + "x realtime)");
+                    continue;
+                }
+
+                String problem;
+                const auto differenceDb = getSpectralDifference (golden, result, problem);
+                result.deleteFile();
+
+                if (problem.isEmpty() && differenceDb > spectralToleranceDb)
+                    problem = "spectrum differs by " + String (differenceDb, 2) + " dB";
+
+                if (problem.isEmpty() && baseline != nullptr) {
+                    if (auto c = baseline->getChildByAttribute ("name", name)) {
+                        const auto expected = c->getDoubleAttribute ("realtimeFactor");
+
+                        if (realtimeFactor < expected * (1.0 - throughputTolerance))
+                            problem = "throughput fell from " + String (expected, 1) + "x to " + String (realtimeFactor, 1) + "x realtime";
+                    }
+                }
+
+                log ((problem.isEmpty() ? "PASS " : "FAIL ") + name + " (" + String (differenceDb, 2) + " dB, "
+                        + String (realtimeFactor, 1) + "x realtime)" + (problem.isEmpty() ? String() : ": " + problem));
+
+                if (problem.isNotEmpty())
+                    ++failures;
+            }
+        }
+
+        if (update)
+            newBaseline.writeTo (baselineFile);
+
+        log (String (failures) + " failure(s)");
+        return failures;
+    }
+
+    // Renders the first input through a batch worker process, the way apollon --batch does, and checks
+    // the worker built its own pitch chain and wrote the file. Returns the number of failures.
+    int runBatchCase() {
+        const auto inputs = findInputs (root.getChildFile ("inputs"));
+
+        if (inputs.isEmpty())
+            return 0;
+
+        auto outputFolder = root.getChildFile ("batch");
+        outputFolder.deleteRecursively();
+
+        Batch::Coordinator coordinator ({ inputs.getFirst() }, outputFolder, semitoneCases[0], 1);
+        const bool succeeded = coordinator.run() == 0 && outputFolder.getNumberOfChildFiles (File::findFiles) == 1;
+        outputFolder.deleteRecursively();
+
+        log ((succeeded ? "PASS " : "FAIL ") + String ("batch worker"));
+        return succeeded ? 0 : 1;
+    }
+
+    static constexpr double longInputHours = 10.0;
+    static constexpr int64 maxLongInputGrowthBytes = (int64) 256 << 20;
+
+    // Writes a synthetic ten-hour stereo file into the folder, over 6 GB and so RF64, then opens it the way
+    // the app does: as a clip, and as streamed peaks. Fails if either gets the length wrong, if the peaks
+    // never complete, or if the process's resident memory, sampled throughout, grows by more than
+    // maxLongInputGrowthBytes while loading it. The file is generated and deleted again, it needs that much free disk for the run.
+    // Returns the number of failures.
+    int runLongInputCase() {
+        const auto file = root.getChildFile ("long_input.wav");
+        const auto numSamples = (int64) (longInputHours * 60.0 * 60.0 * referenceSampleRate);
+        const auto name = String (longInputHours, 0) + " h input";
+
+        // A 441 Hz tone is exactly 100 samples long, so one table covers the whole file.
+        float period[100];
+
+        for (int i = 0; i < 100; ++i)
+            period[i] = 0.25f * (float) std::sin (MathConstants<double>::twoPi * i / 100.0);
+
+        auto tone = [&period] (AudioBuffer<float>& block, int64 start) {
+            for (int i = 0; i < block.getNumSamples(); ++i) {
+                const auto s = period[(start + i) % 100];
+                block.setSample (0, i, s);
+                block.setSample (1, i, -s);
+            }
+        };
+
+        log ("Writing " + file.getFullPathName());
+
+        if (! writeSynthetic (file, referenceSampleRate, numSamples, 16, tone)) {
+            file.deleteFile();
+            log ("FAIL " + name + ": couldn't write " + file.getFullPathName());
+            return 1;
+        }
+
+        const auto memoryBefore = getResidentMemoryBytes();
+        int64 memoryPeak = memoryBefore;
+        const auto start = Time::getMillisecondCounterHiRes();
+        const auto problem = loadLongInput (file, numSamples, memoryPeak);
+        const auto seconds = (Time::getMillisecondCounterHiRes() - start) / 1000.0;
+        const auto growth = memoryPeak - memoryBefore;
+
+        file.deleteFile();
+
+        String result = problem;
+
+        if (result.isEmpty() && growth > maxLongInputGrowthBytes)
+            result = "resident memory grew by " + String (growth >> 20) + " MB";
+
+        log ((result.isEmpty() ? "PASS " : "FAIL ") + name + " (loaded in " + String (seconds, 1) + " s, resident memory +"
+                + String (growth >> 20) + " MB)" + (result.isEmpty() ? String() : ": " + result));
+
+        return result.isEmpty() ? 0 : 1;
+    }
+
+private:
+    te::Engine& engine;
+    const File root;
+    const bool update;
+
+    static void log (const String& message) {
+        std::cout << message << std::endl;
+    }
+
+    // Returns the memory the process holds right now, or 0 where that can't be asked. Unlike the
+    // peak getrusage() reports, this falls again, so earlier cases in the run don't hide this one.
+    static int64 getResidentMemoryBytes() {
+       #if JUCE_LINUX
+        // The second field is the resident set, in pages.
+        const auto fields = StringArray::fromTokens (File ("/proc/self/statm").loadFileAsString(), false);
+        return fields[1].getLargeIntValue() * (int64) sysconf (_SC_PAGESIZE);
+       #elif JUCE_MAC
+        mach_task_basic_info info {};
+        mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+
+        if (task_info (mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t) &info, &count) != KERN_SUCCESS)
+            return 0;
+
+        return (int64) info.resident_size;
+       #else
+        return 0;
+       #endif
+    }
+
+    // Opens the long input as a clip and scans its peaks, returning what went wrong or an empty string.
+    // Resident memory is sampled along the way, and peak raised to the most seen.
+    String loadLongInput (const File& file, int64 numSamples, int64& peak) {
+        auto sample = [&peak] { peak = jmax (peak, getResidentMemoryBytes()); };
+        const double expectedSeconds = (double) numSamples / referenceSampleRate;
+
+        {
+            te::Edit edit (engine, te::createEmptyEdit (engine), te::Edit::forRendering, nullptr, 0);
+            auto clip = Helpers::loadAudioFileAsClip (edit, file);
+
+            if (clip == nullptr)
+                return "couldn't load it as a clip";
+
+            if (std::abs (clip->getEditTimeRange().getLength() - expectedSeconds) > 1.0)
+                return "the clip is " + String (clip->getEditTimeRange().getLength(), 1) + " s long";
+
+            sample();
+            edit.getTempDirectory (false).deleteRecursively();
+        }
+
+        StreamingPeaks peaks (engine);
+        peaks.setFile (file);
+
+        while (peaks.isScanning()) {
+            sample();
+            Thread::sleep (100);
+        }
+
+        sample();
+
+        if (peaks.getProgress() < 1.0f)
+            return "the peaks stopped at " + String (roundToInt (peaks.getProgress() * 100.0f)) + "%";
+
+        return {};
+    }
+
+    Array<File> findInputs (const File& folder) {
+        auto files = folder.findChildFiles (File::findFiles, false, engine.getAudioFileFormatManager().readFormatManager.getWildcardForAllFormats());
+        files.sort();
+        return files;
+    }
+
+    //==============================================================================
+    static constexpr double referenceSampleRate = 44100.0;
+    static constexpr double referenceSeconds = 8.0;
+
+    // Fills a block of a synthetic input, given the index of its first sample in the file.
+    using Generator = std::function<void (AudioBuffer<float>& block, int64 startSample)>;
+
+    // Writes a stereo WAV from a generator a block at a time, so the memory used doesn't depend on the length.
+    static bool writeSynthetic (const File& f, double sampleRate, int64 numSamples, int bitDepth, const Generator& generate) {
+        f.deleteFile();
+        std::unique_ptr<OutputStream> out (f.createOutputStream());
+        std::unique_ptr<AudioFormatWriter> writer (out != nullptr ? WavAudioFormat().createWriterFor (out.get(), sampleRate, 2, bitDepth, {}, 0)
+                                                                  : nullptr);
+
+        if (writer == nullptr)
+            return false;
+
+        out.release();
+        AudioBuffer<float> block (2, 8192);
+
+        for (int64 pos = 0; pos < numSamples; pos += block.getNumSamples()) {
+            const int n = (int) jmin ((int64) block.getNumSamples(), numSamples - pos);
+            block.clear();
+            generate (block, pos);
+
+            if (! writer->writeFromAudioSampleBuffer (block, 0, n))
+                return false;
+        }
+
+        return true;
+    }
+
+    // Synthesises the reference inputs described at the top of the class.
+    static bool writeReferenceInputs (const File& folder) {
+        folder.createDirectory();
+        const auto numSamples = (int64) (referenceSeconds * referenceSampleRate);
+
+        // A 220 Hz tone with ten decaying harmonics, the right channel a little brighter than the left.
+        auto tone = [] (AudioBuffer<float>& block, int64 start) {
+            for (int i = 0; i < block.getNumSamples(); ++i) {
+                const double t = (double) (start + i) / referenceSampleRate;
+
+                for (int h = 1; h <= 10; ++h) {
+                    const auto s = (float) std::sin (MathConstants<double>::twoPi * 220.0 * h * t);
+                    block.addSample (0, i, 0.3f * s / (float) (h * h));
+                    block.addSample (1, i, 0.3f * s / (float) h / 2.0f);
+                }
+            }
+        };
+
+        // An exponential sweep from 40 Hz to 12 kHz over the whole file.
+        auto sweep = [numSamples] (AudioBuffer<float>& block, int64 start) {
+            const double length = (double) numSamples / referenceSampleRate;
+            const double k = std::log (12000.0 / 40.0);
+
+            for (int i = 0; i < block.getNumSamples(); ++i) {
+                const double t = (double) (start + i) / referenceSampleRate;
+                const auto s = 0.4f * (float) std::sin (MathConstants<double>::twoPi * 40.0 * length / k * (std::exp (k * t / length) - 1.0));
+                block.setSample (0, i, s);
+                block.setSample (1, i, s);
+            }
+        };
+
+        // A note every quarter second from a fixed sequence, each starting with a short burst of noise.
+        auto plucks = [] (AudioBuffer<float>& block, int64 start) {
+            static constexpr double notes[] = { 196.0, 261.63, 329.63, 392.0, 293.66, 246.94, 440.0, 349.23 };
+            const auto noteLength = (int64) (referenceSampleRate / 4.0);
+
+            for (int i = 0; i < block.getNumSamples(); ++i) {
+                const int64 sample = start + i;
+                const int64 note = sample / noteLength;
+                const double t = (double) (sample % noteLength) / referenceSampleRate;
+                const double frequency = notes[note % (int64) std::size (notes)];
+
+                // The noise is seeded per sample, so it doesn't depend on how the file is split into blocks.
+                Random random (sample);
+                const auto noise = t < 0.005 ? random.nextFloat() * 2.0f - 1.0f : 0.0f;
+                const auto s = (float) (std::exp (-6.0 * t) * std::sin (MathConstants<double>::twoPi * frequency * t));
+
+                block.setSample (0, i, 0.4f * s + 0.2f * noise);
+                block.setSample (1, i, 0.4f * s - 0.2f * noise);
+            }
+        };
+
+        return writeSynthetic (folder.getChildFile ("tone.wav"), referenceSampleRate, numSamples, 24, tone)
+            && writeSynthetic (folder.getChildFile ("sweep.wav"), referenceSampleRate, numSamples, 24, sweep)
+            && writeSynthetic (folder.getChildFile ("plucks.wav"), referenceSampleRate, numSamples, 24, plucks);
+    }
+
+    // Renders one input at the given transposition, measuring how many times faster than realtime it ran.
+    String renderCase (const File& input, float semitones, const File& output, double& realtimeFactor) {
+        double elapsedSeconds = 0.0;
+        const auto error = ExportJob::renderFile (engine, input, semitones, output, &elapsedSeconds);
+
+        realtimeFactor = te::AudioFile (engine, input).getLength() / jmax (elapsedSeconds, 0.001);
+
+        return error;
+    }
+
+    // Reads a file into a mono buffer.
+    bool readMono (const File& f, AudioBuffer<float>& mono, double& sampleRate) {
+        std::unique_ptr<AudioFormatReader> reader (engine.getAudioFileFormatManager().readFormatManager.createReaderFor (f));
+
+        if (reader == nullptr)
+            return false;
+
+        AudioBuffer<float> buffer ((int) reader->numChannels, (int) reader->lengthInSamples);
+        reader->read (&buffer, 0, buffer.getNumSamples(), 0, true, true);
+
+        mono.setSize (1, buffer.getNumSamples());
+        mono.clear();
+
+        for (int ch = 0; ch < buffer.getNumChannels(); ++ch)
+            mono.addFrom (0, 0, buffer, ch, 0, buffer.getNumSamples(), 1.0f / buffer.getNumChannels());
+
+        sampleRate = reader->sampleRate;
+        return true;
+    }
+
+    // Returns the mean absolute difference in dB between the magnitude spectra of the two files,
+    // over every frame and every bin where the golden is above the noise floor.
+    float getSpectralDifference (const File& golden, const File& result, String& problem) {
+        AudioBuffer<float> a, b;
+        double rateA = 0.0, rateB = 0.0;
+
+        if (! readMono (golden, a, rateA)) { problem = "missing golden " + golden.getFileName(); return 0.0f; }
+        if (! readMono (result, b, rateB)) { problem = "unreadable render";                      return 0.0f; }
+
+        if (rateA != rateB)
+            { problem = "sample rate changed"; return 0.0f; }
+
+        if (std::abs (a.getNumSamples() - b.getNumSamples()) > a.getNumSamples() / 100)
+            { problem = "length changed from " + String (a.getNumSamples()) + " to " + String (b.getNumSamples()) + " samples"; return 0.0f; }
+
+        constexpr int order = 11, size = 1 << order, hop = size / 2;
+        dsp::FFT fft (order);
+        dsp::WindowingFunction<float> window (size, dsp::WindowingFunction<float>::hann, false);
+        HeapBlock<float> frameA (2 * size), frameB (2 * size);
+
+        const int numSamples = jmin (a.getNumSamples(), b.getNumSamples());
+        double totalDifference = 0.0;
+        int64 numBins = 0;
+
+        for (int start = 0; start + size <= numSamples; start += hop) {
+            FloatVectorOperations::copy (frameA, a.getReadPointer (0, start), size);
+            FloatVectorOperations::copy (frameB, b.getReadPointer (0, start), size);
+            window.multiplyWithWindowingTable (frameA, size);
+            window.multiplyWithWindowingTable (frameB, size);
+            fft.performFrequencyOnlyForwardTransform (frameA);
+            fft.performFrequencyOnlyForwardTransform (frameB);
+
+            for (int bin = 1; bin < size / 2; ++bin) {
+                const auto dbA = Decibels::gainToDecibels (frameA[bin], -120.0f);
+
+                if (dbA < -90.0f)
+                    continue;
+
+                totalDifference += std::abs (dbA - Decibels::gainToDecibels (frameB[bin], -120.0f));
+                ++numBins;
+            }
+        }
+
+        return numBins > 0 ? (float) (totalDifference / (double) numBins) : 0.0f;
+    }
+};
+//==============================================================================
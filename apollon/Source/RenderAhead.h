@@ -0,0 +1,388 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "ParallelRender.h"
+#include "ThreadPolicy.h"
+#include "SeekCache.h"
+#include "Resampling.h"
+
+namespace te = tracktion_engine;
+
+//==============================================================================
+/**
+    Pitch-shifts the clip's file on a background thread, keeping a few hundred milliseconds of
+    output queued in a lock-free FIFO, so the audio callback only has to copy it out. The stretcher
+    then works in large blocks on its own schedule, whatever the device's buffer size.
+
+    The audio thread owns the FIFO's read side and is the only one that asks for a refill. It does
+    so when playback jumps somewhere the queued audio doesn't cover, or the transposition changes,
+    and stops reading until the producer reports that the refill it asked for has started. The
+    producer only resets the FIFO in between, so the two never touch the same end at the same time.
+
+    A refill starts a lead time ahead of the playhead, to cover the stretcher's start-up, and plays
+    silence until the playhead reaches it. If it still comes back late, the audio already passed is
+    dropped as it arrives rather than asked for again, which would only come back late again, and
+    the lead is lengthened for the next refill.
+*/
+//==============================================================================
+class RenderAheadBuffer  : private Thread {
+public:
+
+    RenderAheadBuffer (te::Engine& e)
+        : Thread ("render ahead"), engine (e) {
+    }
+
+    ~RenderAheadBuffer() override {
+        stop();
+    }
+
+    static constexpr double aheadSeconds = 0.3;
+    static constexpr double minLeadSeconds = 0.05, maxLeadSeconds = 0.5;
+
+    // Sizes the FIFO and starts the producer. Called on the message thread while the graph is stopped.
+    void prepare (double newSampleRate, int newNumChannels, te::TimeStretcher::Mode newMode) {
+        stop();
+
+        sampleRate = newSampleRate;
+        numChannels = newNumChannels;
+        mode = newMode;
+        resamplingQuality = Resampling::getQuality (engine);
+
+        const int capacity = roundToInt (aheadSeconds * sampleRate) + 2 * ParallelPitchRenderer::blockSize;
+        fifoBuffer.setSize (numChannels, capacity);
+        fifo.setTotalSize (capacity);
+        fifo.reset();
+
+        requestedGeneration = 0;
+        readyGeneration = -1;
+        lastSemitones = std::numeric_limits<float>::quiet_NaN();
+        leadSeconds = minLeadSeconds;
+
+        startThread (7);
+    }
+
+    void stop() {
+        stopThread (2000);
+    }
+
+    // Sets what is being played: the clip's file, where the clip sits in the edit and the loop.
+    // Called on the message thread, playback is resynchronised on the next block.
+    void setSource (const File& file, double clipStart, double clipOffset, te::EditTimeRange loop, bool looping) {
+        {
+            const ScopedLock sl (sourceLock);
+            source = { file, clipStart, clipOffset, loop, looping };
+        }
+
+        loopStart = loop.getStart();
+        loopEnd = loop.getEnd();
+        isLooping = looping;
+        resyncRequested = true;
+    }
+
+    // Copies the queued output for this block into dest. Called on the audio thread, never blocks or allocates.
+    // Outputs silence while a refill is under way.
+    void read (AudioBuffer<float>& dest, int startSample, int numSamples, double editTime, bool isPlaying, float semitones) noexcept {
+        if (! isPlaying) {
+            dest.clear (startSample, numSamples);
+            return;
+        }
+
+        if (semitones != lastSemitones || resyncRequested.exchange (false))
+            requestRefill (editTime, semitones);
+
+        if (readyGeneration.load (std::memory_order_acquire) != requestedGeneration.load (std::memory_order_relaxed)) {
+            dest.clear (startSample, numSamples);
+            return;
+        }
+
+        auto behind = getSamplesBehind (editTime);
+        int silent = 0;
+
+        if (catchingUp && ! lateChecked) {
+            lateChecked = true;
+
+            // The producer took longer than the lead to get going, give the next refill that much more.
+            if (behind > 0)
+                leadSeconds = jmin (maxLeadSeconds, leadSeconds + behind / sampleRate + minLeadSeconds);
+        }
+
+        if (catchingUp && behind > 0 && behind <= roundToInt (maxLeadSeconds * sampleRate)) {
+            // Late: drop what the playhead has already passed, and wait for the rest if it isn't here yet.
+            const auto dropped = (int) jmin (behind, (int64) fifo.getNumReady());
+            discard (dropped);
+            behind -= dropped;
+
+            if (behind > 0) {
+                dest.clear (startSample, numSamples);
+                return;
+            }
+        }
+        else if (catchingUp && behind < 0 && -behind <= roundToInt (maxLeadSeconds * sampleRate) + numSamples) {
+            // Early: the refill starts ahead of the playhead, so play silence until it gets there.
+            silent = (int) jmin ((int64) numSamples, -behind);
+        }
+        else if (behind != 0) {
+            // Playback jumped somewhere the queue doesn't cover.
+            requestRefill (editTime, semitones);
+            dest.clear (startSample, numSamples);
+            return;
+        }
+
+        if (silent > 0)
+            dest.clear (startSample, silent);
+
+        const int numToRead = numSamples - silent;
+
+        if (numToRead == 0)
+            return;
+
+        // Underrun: the producer has fallen behind, so catch up as its output arrives rather than asking again.
+        if (fifo.getNumReady() < numToRead) {
+            dest.clear (startSample + silent, numToRead);
+            catchingUp = true;
+            return;
+        }
+
+        int start1, size1, start2, size2;
+        fifo.prepareToRead (numToRead, start1, size1, start2, size2);
+
+        for (int ch = 0; ch < dest.getNumChannels(); ++ch) {
+            const int srcCh = ch % numChannels;
+            dest.copyFrom (ch, startSample + silent, fifoBuffer, srcCh, start1, size1);
+
+            if (size2 > 0)
+                dest.copyFrom (ch, startSample + silent + size1, fifoBuffer, srcCh, start2, size2);
+        }
+
+        fifo.finishedRead (size1 + size2);
+        advanceHead (numToRead);
+        catchingUp = false;
+
+        // Fade in after a refill so it doesn't start with a click.
+        if (fadeInRemaining > 0) {
+            const int n = jmin (fadeInRemaining, numToRead);
+            const float from = 1.0f - fadeInRemaining / (float) fadeInLength;
+            dest.applyGainRamp (startSample + silent, n, from, from + n / (float) fadeInLength);
+            fadeInRemaining -= n;
+        }
+    }
+
+private:
+    struct Source {
+        File file;
+        double clipStart = 0.0, clipOffset = 0.0;
+        te::EditTimeRange loop;
+        bool looping = false;
+    };
+
+    te::Engine& engine;
+    double sampleRate = 44100.0;
+    int numChannels = 2;
+    te::TimeStretcher::Mode mode = te::TimeStretcher::melodyne;
+    Resampling::Quality resamplingQuality = Resampling::Quality::lagrange;
+
+    AbstractFifo fifo { 1 };
+    AudioBuffer<float> fifoBuffer;
+
+    CriticalSection sourceLock;  // Only ever taken by the message thread and the producer.
+    Source source;
+
+    std::atomic<double> loopStart { 0.0 }, loopEnd { 0.0 };
+    std::atomic<bool> isLooping { false }, resyncRequested { false };
+
+    // Refill requests, written by the audio thread and picked up by the producer.
+    std::atomic<int> requestedGeneration { 0 }, readyGeneration { -1 };
+    std::atomic<double> requestedPosition { 0.0 };
+    std::atomic<float> requestedSemitones { 0.0f };
+
+    // Audio thread only.
+    double headTime = 0.0;  // Edit time of the next sample in the FIFO.
+    float lastSemitones = 0.0f;
+    double leadSeconds = minLeadSeconds;
+    bool catchingUp = false, lateChecked = false;
+    static constexpr int fadeInLength = 256;
+    int fadeInRemaining = 0;
+
+    // Asks for the queue to be refilled from a lead time after the given edit time.
+    void requestRefill (double editTime, float semitones) noexcept {
+        lastSemitones = semitones;
+        headTime = editTime;
+        advanceHead (roundToInt (leadSeconds * sampleRate));
+        catchingUp = true;
+        lateChecked = false;
+        fadeInRemaining = fadeInLength;
+
+        requestedPosition.store (headTime, std::memory_order_relaxed);
+        requestedSemitones.store (semitones, std::memory_order_relaxed);
+        requestedGeneration.fetch_add (1, std::memory_order_release);
+    }
+
+    void discard (int numSamples) noexcept {
+        int start1, size1, start2, size2;
+        fifo.prepareToRead (numSamples, start1, size1, start2, size2);
+        fifo.finishedRead (size1 + size2);
+        advanceHead (numSamples);
+    }
+
+    // Returns how many samples the playhead is past the head of the queue, negative if it hasn't reached it yet.
+    int64 getSamplesBehind (double editTime) const noexcept {
+        auto difference = editTime - headTime;
+        const double end = loopEnd.load (std::memory_order_relaxed), start = loopStart.load (std::memory_order_relaxed);
+
+        // Either side of the loop end, the distance the short way round is the real one.
+        if (isLooping.load (std::memory_order_relaxed) && end > start) {
+            const double length = end - start;
+
+            if (difference > length * 0.5)
+                difference -= length;
+            else if (difference < -length * 0.5)
+                difference += length;
+        }
+
+        return (int64) std::llround (difference * sampleRate);
+    }
+
+    // Moves the head on as the transport would, wrapping at the loop end.
+    void advanceHead (int numSamples) noexcept {
+        headTime += numSamples / sampleRate;
+
+        const double end = loopEnd.load (std::memory_order_relaxed), start = loopStart.load (std::memory_order_relaxed);
+
+        if (isLooping.load (std::memory_order_relaxed) && end > start && headTime >= end - 0.5 / sampleRate)
+            headTime = start + (headTime - end);
+    }
+
+    //==============================================================================
+    void run() override {
+        const int blockSize = ParallelPitchRenderer::blockSize;
+        std::map<int, int> latencies;  // Measured stretcher latency for each transposition, in hundredths of a semitone.
+
+        std::unique_ptr<AudioFormatReaderSource> readerSource;
+        std::unique_ptr<Resampling::Source> resampler;
+        std::unique_ptr<te::TimeStretcher> stretcher;
+        AudioBuffer<float> in, out (numChannels, blockSize);
+        Source current;
+        File readerFile;
+        int generation = -1;
+        int64 inputSample = 0;
+        int toSkip = 0;
+
+        while (! threadShouldExit()) {
+            // On the audio cores with the callback it feeds, but never above it.
+            ThreadPolicy::applyToAudioThread (false);
+
+            const int wanted = requestedGeneration.load (std::memory_order_acquire);
+
+            // The audio thread has stopped reading until we report the new generation, so the FIFO can be reset.
+            if (wanted != generation) {
+                generation = wanted;
+                fifo.reset();
+
+                {
+                    const ScopedLock sl (sourceLock);
+                    current = source;
+                }
+
+                // A refill is usually just a jump in the same file, so the reader is kept rather than
+                // reopened and made to find its way through a compressed file again. A copy already
+                // at our rate is preferred, it needs no conversion at all.
+                const auto playable = SeekCache::resolve (engine, current.file, sampleRate);
+
+                if (playable != readerFile || resampler == nullptr) {
+                    readerSource.reset();
+                    resampler.reset();
+                    readerFile = playable;
+
+                    if (auto reader = engine.getAudioFileFormatManager().readFormatManager.createReaderFor (playable)) {
+                        const double fileRate = reader->sampleRate;
+                        readerSource = std::make_unique<AudioFormatReaderSource> (reader, true);
+                        resampler = std::make_unique<Resampling::Source> (readerSource.get(), numChannels, resamplingQuality);
+                        resampler->setResamplingRatio (fileRate / sampleRate);
+                        resampler->prepareToPlay (blockSize, sampleRate);
+                    }
+                }
+
+                ParallelPitchRenderer::Settings settings;
+                settings.semitones = requestedSemitones.load();
+                settings.mode = mode;
+
+                auto& latency = latencies[roundToInt (settings.semitones * 100.0f)];
+
+                if (latency == 0)
+                    latency = jmax (1, ParallelPitchRenderer::measureLatency (settings, sampleRate, numChannels));
+
+                stretcher = ParallelPitchRenderer::createStretcher (settings, sampleRate, numChannels);
+                in.setSize (numChannels, stretcher->getMaxFramesNeeded());
+
+                // Output sample k is input sample k - latency, so start reading at the position and drop the delay.
+                inputSample = (int64) std::llround (requestedPosition.load() * sampleRate);
+                seekSource (current, inputSample);
+                toSkip = latency;
+
+                readyGeneration.store (generation, std::memory_order_release);
+            }
+
+            if (resampler == nullptr || fifo.getFreeSpace() < blockSize) {
+                wait (5);
+                continue;
+            }
+
+            const int needed = stretcher->getFramesNeeded();
+            fillInput (current, in, needed, inputSample);
+            stretcher->processData (in.getArrayOfReadPointers(), needed, out.getArrayOfWritePointers());
+
+            const int skipped = jmin (toSkip, blockSize);
+            toSkip -= skipped;
+            write (out, skipped, blockSize - skipped);
+        }
+    }
+
+    // Points the reader at the file position that plays at the given edit sample.
+    void seekSource (const Source& s, int64 editSample) {
+        const double fileTime = jmax (0.0, editSample / sampleRate - s.clipStart + s.clipOffset);
+        readerSource->setNextReadPosition ((int64) (fileTime * readerSource->getAudioFormatReader()->sampleRate));
+        resampler->flushBuffers();
+    }
+
+    // Reads the next numSamples of input, jumping back to the loop start whenever it reaches the loop end.
+    void fillInput (const Source& s, AudioBuffer<float>& in, int numSamples, int64& editSample) {
+        const int64 loopStartSample = (int64) std::llround (s.loop.getStart() * sampleRate);
+        const int64 loopEndSample = (int64) std::llround (s.loop.getEnd() * sampleRate);
+        int done = 0;
+
+        while (done < numSamples) {
+            int n = numSamples - done;
+
+            if (s.looping && loopEndSample > loopStartSample)
+                n = (int) jmin ((int64) n, loopEndSample - editSample);
+
+            if (n > 0) {
+                resampler->getNextAudioBlock (AudioSourceChannelInfo (&in, done, n));
+                done += n;
+                editSample += n;
+            }
+
+            if (s.looping && loopEndSample > loopStartSample && editSample >= loopEndSample) {
+                editSample = loopStartSample;
+                seekSource (s, editSample);
+            }
+        }
+    }
+
+    void write (const AudioBuffer<float>& block, int startSample, int numSamples) {
+        int start1, size1, start2, size2;
+        fifo.prepareToWrite (numSamples, start1, size1, start2, size2);
+
+        for (int ch = 0; ch < numChannels; ++ch) {
+            fifoBuffer.copyFrom (ch, start1, block, ch, startSample, size1);
+
+            if (size2 > 0)
+                fifoBuffer.copyFrom (ch, start2, block, ch, startSample + size1, size2);
+        }
+
+        fifo.finishedWrite (size1 + size2);
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (RenderAheadBuffer)
+};
+//==============================================================================
@@ -0,0 +1,394 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "Export.h"
+
+#if JUCE_LINUX || JUCE_MAC
+ #include <sys/socket.h>
+ #include <sys/un.h>
+ #include <unistd.h>
+#endif
+
+namespace te = tracktion_engine;
+
+//==============================================================================
+/**
+    Headless render service, run with
+        apollon --daemon [socket path] [--jobs n]
+
+    The engine is created once, with the pitch shifter registered and the audio formats loaded,
+    and stays warm for every job. Clients connect to a Unix domain socket and exchange one JSON
+    object per line:
+
+        -> {"cmd":"submit", "input":"/a.wav", "output":"/b.wav", "semitones":2, "priority":1}
+        <- {"event":"queued", "id":7}
+        <- {"event":"started", "id":7}
+        <- {"event":"progress", "id":7, "progress":0.42}
+        <- {"event":"done", "id":7}   or   {"event":"failed", "id":7, "error":"..."}
+
+        -> {"cmd":"cancel", "id":7}     <- {"event":"cancelled", "id":7}
+        -> {"cmd":"status"}             <- {"event":"status", "running":[...], "queued":[...]}
+
+    Higher priorities run first, equal priorities in the order they were submitted. Events for a
+    job go to the connection that submitted it. Jobs run through ExportJob, so the graph is built
+    on the message thread and rendered on a background thread.
+*/
+//==============================================================================
+class RenderDaemon  : private Timer {
+public:
+
+    RenderDaemon (te::Engine& e, const File& socket, int maxConcurrentJobs)
+        : engine (e), socketFile (socket), maxRunning (jmax (1, maxConcurrentJobs)) {
+        // Warm everything a job needs, so the first one pays no more than the rest.
+        engine.getPluginManager().createBuiltInType<ApollonPitchShiftPlugin>();
+        engine.getAudioFileFormatManager().readFormatManager.getNumKnownFormats();
+    }
+
+    ~RenderDaemon() override {
+        stopTimer();
+
+        // Shutting the socket down is what wakes the listener out of accept().
+       #if JUCE_LINUX || JUCE_MAC
+        if (listenSocket >= 0)
+            ::shutdown (listenSocket, SHUT_RDWR);
+       #endif
+
+        if (listener != nullptr)
+            listener->stopThread (2000);
+
+        closeSocket (listenSocket);
+        socketFile.deleteFile();
+
+        for (auto* c : clients)
+            c->stop();
+
+        running.clear();
+    }
+
+    static File getDefaultSocketFile() {
+        return File::getSpecialLocation (File::tempDirectory).getChildFile ("apollon.sock");
+    }
+
+    // Binds the socket and starts accepting clients. Returns an error message, or an empty string on success.
+    String start() {
+       #if JUCE_LINUX || JUCE_MAC
+        sockaddr_un address {};
+        address.sun_family = AF_UNIX;
+
+        if (socketFile.getFullPathName().getNumBytesAsUTF8() >= sizeof (address.sun_path))
+            return "Socket path is too long: " + socketFile.getFullPathName();
+
+        socketFile.getFullPathName().copyToUTF8 (address.sun_path, sizeof (address.sun_path));
+
+        // A socket file left behind by a daemon that died would make bind fail.
+        socketFile.deleteFile();
+        listenSocket = ::socket (AF_UNIX, SOCK_STREAM, 0);
+
+        if (listenSocket < 0
+             || ::bind (listenSocket, (sockaddr*) &address, sizeof (address)) != 0
+             || ::listen (listenSocket, 16) != 0)
+            return "Couldn't listen on " + socketFile.getFullPathName();
+
+        listener = std::make_unique<Listener> (*this);
+        listener->startThread();
+        startTimerHz (4);
+
+        log ("Listening on " + socketFile.getFullPathName());
+        return {};
+       #else
+        return "The render daemon needs Unix domain sockets, which this platform doesn't have";
+       #endif
+    }
+
+private:
+    //==============================================================================
+    // One connected client. Reads requests on its own thread and hands them to the message thread.
+    struct Client  : private Thread {
+        Client (RenderDaemon& o, int s, int clientId)
+            : Thread ("daemon client"), owner (o), socket (s), id (clientId) {
+           #if JUCE_MAC
+            int on = 1;
+            setsockopt (socket, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof (on));
+           #endif
+            startThread();
+        }
+
+        ~Client() override {
+            stop();
+        }
+
+        void stop() {
+            signalThreadShouldExit();
+           #if JUCE_LINUX || JUCE_MAC
+            if (socket >= 0)
+                ::shutdown (socket, SHUT_RDWR);
+           #endif
+            stopThread (2000);
+            closeSocket (socket);
+        }
+
+        // Sends one event line. Called on the message thread.
+        void send (const var& event) {
+           #if JUCE_LINUX || JUCE_MAC
+            const auto line = JSON::toString (event, true) + "\n";
+            const ScopedLock sl (writeLock);
+
+           #if JUCE_LINUX
+            const int flags = MSG_NOSIGNAL;
+           #else
+            const int flags = 0;
+           #endif
+
+            if (socket >= 0)
+                ::send (socket, line.toRawUTF8(), line.getNumBytesAsUTF8(), flags);
+           #else
+            ignoreUnused (event);
+           #endif
+        }
+
+        RenderDaemon& owner;
+        int socket;
+        const int id;
+        CriticalSection writeLock;
+
+    private:
+        void run() override {
+           #if JUCE_LINUX || JUCE_MAC
+            std::string pending;
+            char buffer[4096];
+
+            while (! threadShouldExit()) {
+                const auto n = ::recv (socket, buffer, sizeof (buffer), 0);
+
+                if (n <= 0)
+                    break;
+
+                pending.append (buffer, (size_t) n);
+
+                for (auto newline = pending.find ('\n'); newline != std::string::npos; newline = pending.find ('\n')) {
+                    const auto line = String::fromUTF8 (pending.data(), (int) newline);
+                    pending.erase (0, newline + 1);
+
+                    MessageManager::callAsync ([daemon = &owner, clientId = id, request = JSON::parse (line)] {
+                        daemon->handleRequest (clientId, request);
+                    });
+                }
+            }
+
+            MessageManager::callAsync ([daemon = &owner, clientId = id] { daemon->removeClient (clientId); });
+           #endif
+        }
+    };
+
+    //==============================================================================
+    // Accepts connections on its own thread.
+    struct Listener  : public Thread {
+        Listener (RenderDaemon& o) : Thread ("daemon listener"), owner (o) {}
+
+        void run() override {
+           #if JUCE_LINUX || JUCE_MAC
+            while (! threadShouldExit()) {
+                const int s = ::accept (owner.listenSocket, nullptr, nullptr);
+
+                if (s < 0)
+                    break;
+
+                MessageManager::callAsync ([daemon = &owner, s] { daemon->addClient (s); });
+            }
+           #endif
+        }
+
+        RenderDaemon& owner;
+    };
+
+    //==============================================================================
+    struct Job {
+        int id, clientId, priority;
+        File input, output;
+        float semitones;
+
+        // Only set while the job is running.
+        std::unique_ptr<te::Edit> edit;
+        std::unique_ptr<ExportJob> render;
+    };
+
+    te::Engine& engine;
+    const File socketFile;
+    const int maxRunning;
+
+    int listenSocket = -1;
+    std::unique_ptr<Listener> listener;
+    OwnedArray<Client> clients;
+    OwnedArray<Job> queued, running;
+    int nextClientId = 0, nextJobId = 1;
+
+    static void log (const String& message) {
+        std::cout << message << std::endl;
+    }
+
+    static void closeSocket (int& s) {
+       #if JUCE_LINUX || JUCE_MAC
+        if (s >= 0)
+            ::close (s);
+       #endif
+        s = -1;
+    }
+
+    static var makeEvent (const String& name, int jobId) {
+        auto* o = new DynamicObject();
+        o->setProperty ("event", name);
+
+        if (jobId > 0)
+            o->setProperty ("id", jobId);
+
+        return o;
+    }
+
+    //==============================================================================
+    void addClient (int s) {
+        clients.add (new Client (*this, s, ++nextClientId));
+    }
+
+    void removeClient (int clientId) {
+        for (int i = clients.size(); --i >= 0;)
+            if (clients.getUnchecked (i)->id == clientId)
+                clients.remove (i);
+    }
+
+    void send (int clientId, const var& event) {
+        for (auto* c : clients)
+            if (c->id == clientId)
+                c->send (event);
+    }
+
+    void handleRequest (int clientId, const var& request) {
+        const auto cmd = request["cmd"].toString();
+
+        if (cmd == "submit") {
+            auto job = std::make_unique<Job>();
+            job->id = nextJobId++;
+            job->clientId = clientId;
+            job->priority = (int) request["priority"];
+            job->input = File (request["input"].toString());
+            job->output = File (request["output"].toString());
+            job->semitones = (float) request["semitones"];
+
+            send (clientId, makeEvent ("queued", job->id));
+
+            // Keep the queue sorted, highest priority first and in submission order within a priority.
+            int index = 0;
+
+            while (index < queued.size() && queued.getUnchecked (index)->priority >= job->priority)
+                ++index;
+
+            queued.insert (index, job.release());
+            startNextJobs();
+        }
+        else if (cmd == "cancel") {
+            cancel ((int) request["id"], clientId);
+        }
+        else if (cmd == "status") {
+            auto status = makeEvent ("status", 0);
+            Array<var> runningIds, queuedIds;
+
+            for (auto* j : running)   runningIds.add (j->id);
+            for (auto* j : queued)    queuedIds.add (j->id);
+
+            status.getDynamicObject()->setProperty ("running", runningIds);
+            status.getDynamicObject()->setProperty ("queued", queuedIds);
+            send (clientId, status);
+        }
+        else {
+            auto error = makeEvent ("error", 0);
+            error.getDynamicObject()->setProperty ("error", "Unknown command: " + cmd);
+            send (clientId, error);
+        }
+    }
+
+    void cancel (int jobId, int clientId) {
+        for (int i = queued.size(); --i >= 0;) {
+            if (queued.getUnchecked (i)->id == jobId) {
+                send (queued.getUnchecked (i)->clientId, makeEvent ("cancelled", jobId));
+                queued.remove (i);
+                return;
+            }
+        }
+
+        // A running job reports back through its finished callback once the render thread has stopped.
+        for (auto* j : running) {
+            if (j->id == jobId) {
+                j->render->cancel();
+                return;
+            }
+        }
+
+        auto error = makeEvent ("error", jobId);
+        error.getDynamicObject()->setProperty ("error", "No such job");
+        send (clientId, error);
+    }
+
+    void startNextJobs() {
+        while (running.size() < maxRunning && ! queued.isEmpty()) {
+            auto* job = running.add (queued.removeAndReturn (0));
+
+            job->edit = std::make_unique<te::Edit> (engine, te::createEmptyEdit (engine), te::Edit::forRendering, nullptr, 0);
+            auto track = Helpers::getOrInsertAudioTrackAt (*job->edit, 0);
+            auto plugin = ApollonPitchShiftPlugin::getOrInsert (*track);
+            auto clip = Helpers::loadAudioFileAsClip (*job->edit, job->input);
+
+            if (clip == nullptr || plugin == nullptr) {
+                finished (job->id, false, false, TRANS("Couldn't read") + " " + job->input.getFileName());
+                continue;
+            }
+
+            Helpers::preparePitchShiftClip (*clip);
+            plugin->getAutomatableParameterByID ("semitones up")->setParameter (job->semitones, dontSendNotification);
+
+            job->render = std::make_unique<ExportJob> (*clip, job->output,
+                                                        [this, jobId = job->id] (bool succeeded, bool cancelled, const String& error) {
+                                                            finished (jobId, succeeded, cancelled, error);
+                                                        });
+            send (job->clientId, makeEvent ("started", job->id));
+            job->render->start();
+        }
+    }
+
+    void finished (int jobId, bool succeeded, bool cancelled, const String& error) {
+        for (int i = running.size(); --i >= 0;) {
+            auto* job = running.getUnchecked (i);
+
+            if (job->id != jobId)
+                continue;
+
+            auto event = makeEvent (succeeded ? "done" : cancelled ? "cancelled" : "failed", jobId);
+
+            if (! succeeded && ! cancelled)
+                event.getDynamicObject()->setProperty ("error", Helpers::getStringOrDefault (error, TRANS("Nothing was rendered")));
+
+            send (job->clientId, event);
+
+            if (job->edit != nullptr)
+                job->edit->getTempDirectory (false).deleteRecursively();
+
+            running.remove (i);
+        }
+
+        // Not started straight from here, this may be running inside the job's own start.
+        MessageManager::callAsync ([this] { startNextJobs(); });
+    }
+
+    // Streams the progress of every running job.
+    void timerCallback() override {
+        for (auto* job : running) {
+            if (job->render == nullptr)
+                continue;
+
+            auto event = makeEvent ("progress", job->id);
+            event.getDynamicObject()->setProperty ("progress", job->render->getProgress());
+            send (job->clientId, event);
+        }
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (RenderDaemon)
+};
+//==============================================================================
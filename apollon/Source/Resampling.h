@@ -0,0 +1,188 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "AppSettings.h"
+
+namespace te = tracktion_engine;
+
+//==============================================================================
+/**
+    Explicit sample-rate conversion, chosen from the fx menu or with --src.
+
+    With pre-conversion on, each file whose rate differs from the device's is converted once in the
+    background with the chosen quality (see SeekCache), and the clip then plays from that copy, so
+    neither normal playback nor render-ahead converts anything. Until the copy is ready, and with
+    pre-conversion off, normal playback goes through tracktion's own resampler, which can't be
+    configured, and render-ahead through the quality chosen here. Exports are made from the file
+    itself, at its own rate.
+
+    Three qualities are offered: linear (cheapest), 4-point Lagrange, and windowed sinc (best,
+    and by far the most expensive). The choice is stored in the app settings. With
+    pre-conversion on, each file is also converted once in the background to the device's rate
+    (see SeekCache), so playback that finds the converted copy does no conversion at all.
+*/
+//==============================================================================
+namespace Resampling {
+
+    enum class Quality { linear, lagrange, sinc };
+
+    inline String getName (Quality q) {
+        switch (q) {
+            case Quality::linear:   return "linear";
+            case Quality::lagrange: return "lagrange";
+            case Quality::sinc:     return "sinc";
+        }
+
+        return {};
+    }
+
+    inline Quality getQuality (const AppSettings& settings) {
+        const auto name = settings.get ("srcQuality").toString();
+
+        if (name == getName (Quality::linear))  return Quality::linear;
+        if (name == getName (Quality::sinc))    return Quality::sinc;
+
+        return Quality::lagrange;
+    }
+
+    inline void setQuality (AppSettings settings, Quality q) {
+        settings.set ("srcQuality", getName (q));
+    }
+
+    // Returns true if files should be converted to the device's rate in the background as they're loaded.
+    inline bool shouldPreconvert (const AppSettings& settings) {
+        return (bool) settings.get ("srcPreconvert");
+    }
+
+    inline void setPreconvert (AppSettings settings, bool shouldConvert) {
+        settings.set ("srcPreconvert", shouldConvert);
+    }
+
+    //==============================================================================
+    // JUCE's interpolators share no base class, so each is wrapped behind this one.
+    struct Interpolator {
+        virtual ~Interpolator() = default;
+        virtual int process (double ratio, const float* in, float* out, int numOut) noexcept = 0;
+        virtual void reset() noexcept = 0;
+        virtual int getLatency() const noexcept = 0;
+    };
+
+    template <typename Type>
+    struct InterpolatorOf  : public Interpolator {
+        int process (double ratio, const float* in, float* out, int numOut) noexcept override   { return interpolator.process (ratio, in, out, numOut); }
+        void reset() noexcept override                                                          { interpolator.reset(); }
+        int getLatency() const noexcept override                                                { return (int) std::ceil (Type::getBaseLatency()); }
+
+        Type interpolator;
+    };
+
+    inline std::unique_ptr<Interpolator> createInterpolator (Quality q) {
+        switch (q) {
+            case Quality::linear:   return std::make_unique<InterpolatorOf<LinearInterpolator>>();
+            case Quality::sinc:     return std::make_unique<InterpolatorOf<WindowedSincInterpolator>>();
+            case Quality::lagrange: break;
+        }
+
+        return std::make_unique<InterpolatorOf<LagrangeInterpolator>>();
+    }
+
+    //==============================================================================
+    /**
+        Drop-in for ResamplingAudioSource with a choice of interpolator.
+
+        Input is pulled into a small pending buffer and consumed as the interpolators need it. After
+        a flush the interpolators' own delay is fed through and dropped, so output sample 0 lines up
+        with the position the input was seeked to. At a ratio of exactly 1 the input is passed straight through.
+    */
+    class Source  : public AudioSource {
+    public:
+        Source (AudioSource* inputSource, int channels, Quality quality)
+            : input (inputSource), numChannels (channels) {
+            for (int ch = 0; ch < numChannels; ++ch)
+                interpolators.push_back (createInterpolator (quality));
+        }
+
+        // Sets how many input samples make one output sample.
+        void setResamplingRatio (double inputPerOutput) {
+            ratio = jmax (0.001, inputPerOutput);
+            flushBuffers();
+        }
+
+        void prepareToPlay (int blockSize, double sampleRate) override {
+            pending.setSize (numChannels, (int) std::ceil (blockSize * ratio) + 2 * interpolators.front()->getLatency() + 8);
+            discard.setSize (1, pending.getNumSamples());
+            input->prepareToPlay ((int) std::ceil (blockSize * ratio) + 1, sampleRate * ratio);
+            flushBuffers();
+        }
+
+        void releaseResources() override {
+            input->releaseResources();
+        }
+
+        // Forgets the history, call it after the input has been seeked.
+        void flushBuffers() {
+            for (auto& i : interpolators)
+                i->reset();
+
+            available = 0;
+            primed = false;
+        }
+
+        void getNextAudioBlock (const AudioSourceChannelInfo& info) override {
+            if (ratio == 1.0) {
+                input->getNextAudioBlock (info);
+                return;
+            }
+
+            if (! primed) {
+                primed = true;
+                const int latency = interpolators.front()->getLatency();
+                produce (discard, 0, (int) (latency / ratio), true);
+            }
+
+            produce (*info.buffer, info.startSample, info.numSamples, false);
+        }
+
+    private:
+        AudioSource* input;
+        const int numChannels;
+        std::vector<std::unique_ptr<Interpolator>> interpolators;
+
+        AudioBuffer<float> pending, discard;
+        double ratio = 1.0;
+        int available = 0;
+        bool primed = false;
+
+        void produce (AudioBuffer<float>& dest, int startSample, int numSamples, bool dropOutput) {
+            if (numSamples <= 0)
+                return;
+
+            const int needed = (int) std::ceil (numSamples * ratio) + 2;
+
+            if (needed > pending.getNumSamples())
+                pending.setSize (numChannels, needed, true, false, true);
+
+            if (dropOutput && numSamples > discard.getNumSamples())
+                discard.setSize (1, numSamples, false, false, true);
+
+            if (available < needed) {
+                input->getNextAudioBlock (AudioSourceChannelInfo (&pending, available, needed - available));
+                available = needed;
+            }
+
+            int used = 0;
+
+            for (int ch = 0; ch < numChannels; ++ch) {
+                auto* out = dropOutput ? discard.getWritePointer (0) : dest.getWritePointer (jmin (ch, dest.getNumChannels() - 1), startSample);
+                used = interpolators[(size_t) ch]->process (ratio, pending.getReadPointer (ch), out, numSamples);
+            }
+
+            // Keep what the interpolators didn't get to for the next block.
+            available -= used;
+
+            for (int ch = 0; ch < numChannels; ++ch)
+                std::memmove (pending.getWritePointer (ch), pending.getReadPointer (ch, used), sizeof (float) * (size_t) available);
+        }
+    };
+}
+//==============================================================================
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "ThreadPolicy.h"
+#include "Resampling.h"
+
+namespace te = tracktion_engine;
+
+//==============================================================================
+/**
+    Sample-addressable copies of compressed sources, so seeking into them costs no more than a read.
+
+    A fresh MP3 or Ogg reader has to scan or bisect its way to a distant position, and so does
+    tracktion's playback reader every time the thumbnail is dragged or the loop wraps. The first
+    time a compressed file is loaded it is decoded once, sequentially, into a WAV kept in the
+    engine's temp folder. That copy is keyed on the source's path, size and modification time, so
+    it survives relaunches and is dropped as soon as the source changes. Once it's ready the clip
+    plays from it (see playFromCopy()), as do render-ahead refills, peak chunks and export
+    segments, and every seek lands on the exact sample with a single read.
+
+    The same cache holds copies converted to the device's rate when pre-conversion is on (see
+    Resampling), with the chosen resampling quality, which is part of their key. The clip plays
+    from one of those in preference, so tracktion's playback reads samples already at the device's
+    rate and does no conversion at all. The clip remembers the file it was loaded from, and is
+    pointed back at it whenever the copy goes away.
+
+    Copies are written under a temporary name and renamed when complete, so resolve() never returns
+    a half-written file. The oldest copies are deleted once the folder passes maxCacheBytes.
+*/
+//==============================================================================
+namespace SeekCache {
+
+    static constexpr int64 maxCacheBytes = (int64) 4 << 30;
+
+    // Sources longer than this aren't copied, the copy would cost more disk than the seeks are worth.
+    static constexpr double maxSourceSeconds = 2.0 * 60.0 * 60.0;
+
+    // Returns true if the file's format can't seek directly to a sample.
+    inline bool needsCopy (const File& source) {
+        return source.existsAsFile() && ! source.hasFileExtension ("wav;wave;bwf;aif;aiff;w64;rf64;caf");
+    }
+
+    inline File getFolder (te::Engine& engine) {
+        return engine.getTemporaryFileManager().getTempDirectory().getChildFile ("seekable");
+    }
+
+    // Returns where the copy of a source lives, whether or not it exists yet. A sample rate of 0 means the source's own.
+    inline File getCopyFile (te::Engine& engine, const File& source, double sampleRate = 0.0) {
+        auto key = source.getFullPathName() + String (source.getSize()) + String (source.getLastModificationTime().toMilliseconds());
+
+        if (sampleRate > 0.0)
+            key << "@" << roundToInt (sampleRate) << Resampling::getName (Resampling::getQuality (engine));
+
+        return getFolder (engine).getChildFile (String::toHexString (key.hashCode64()) + ".wav");
+    }
+
+    // Returns the best finished copy of a source: one already at the given rate, then a seekable
+    // one for a compressed source, otherwise the source itself.
+    inline File resolve (te::Engine& engine, const File& source, double sampleRate = 0.0) {
+        if (sampleRate > 0.0) {
+            const auto converted = getCopyFile (engine, source, sampleRate);
+
+            if (converted.existsAsFile())
+                return converted;
+        }
+
+        if (! needsCopy (source))
+            return source;
+
+        const auto copy = getCopyFile (engine, source);
+        return copy.existsAsFile() ? copy : source;
+    }
+
+    //==============================================================================
+    // Returns the file the clip was loaded from, even while it plays from a copy.
+    inline File getSourceFile (te::AudioClipBase& clip) {
+        const auto source = clip.state.getProperty ("apollonSource").toString();
+        return source.isNotEmpty() ? File (source) : clip.getOriginalFile();
+    }
+
+    // Points the clip at a finished copy of its source. The source is kept in the clip's state, so
+    // getSourceFile() and the next launch still know it.
+    inline void playFromCopy (te::AudioClipBase& clip, const File& copy) {
+        if (! copy.existsAsFile() || clip.getOriginalFile() == copy)
+            return;
+
+        clip.state.setProperty ("apollonSource", getSourceFile (clip).getFullPathName(), nullptr);
+        clip.getSourceFileReference().setToDirectFileReference (copy, false);
+    }
+
+    // Points the clip back at the file it was loaded from.
+    inline void playFromSource (te::AudioClipBase& clip) {
+        const auto source = getSourceFile (clip);
+
+        if (clip.getOriginalFile() != source)
+            clip.getSourceFileReference().setToDirectFileReference (source, false);
+
+        clip.state.removeProperty ("apollonSource", nullptr);
+    }
+
+    //==============================================================================
+    // Decodes compressed sources into their copies on a background thread, one at a time.
+    class Builder  : private Thread {
+    public:
+
+        Builder (te::Engine& e)
+            : Thread ("seek cache"), engine (e) {
+        }
+
+        ~Builder() override {
+            stopThread (5000);
+        }
+
+        // Called on the message thread with a copy once it's finished, or straight from prepare() with the
+        // best one that already exists. A converted copy can follow a seekable one for the same source.
+        std::function<void (const File& source, const File& copy)> onCopyReady;
+
+        // Starts copying the source if it needs a copy and doesn't have one yet, abandoning any copy in progress.
+        // With a sample rate, the copy is converted to that rate, unless the source is already at it.
+        void prepare (const File& source, double sampleRate = 0.0) {
+            const auto existing = resolve (engine, source, sampleRate);
+
+            if (existing != source) {
+                // In use again, so pruning keeps it a while longer.
+                existing.setLastModificationTime (Time::getCurrentTime());
+
+                if (onCopyReady != nullptr)
+                    onCopyReady (source, existing);
+            }
+
+            if (sampleRate <= 0.0 && (! needsCopy (source) || existing != source))
+                return;
+
+            if (sampleRate > 0.0 && existing == getCopyFile (engine, source, sampleRate))
+                return;
+
+            stopThread (5000);
+            file = source;
+            targetRate = sampleRate;
+            startThread (2);
+        }
+
+    private:
+        te::Engine& engine;
+        File file;
+        double targetRate = 0.0;
+
+        void run() override {
+            ThreadPolicy::applyToBackgroundThread();
+
+            auto& formats = engine.getAudioFileFormatManager();
+            std::unique_ptr<AudioFormatReader> reader (formats.readFormatManager.createReaderFor (file));
+
+            if (reader == nullptr || reader->lengthInSamples <= 0 || reader->lengthInSamples > maxSourceSeconds * reader->sampleRate)
+                return;
+
+            // Already at the device's rate, so only a compressed source needs anything doing.
+            if (targetRate > 0.0 && std::abs (reader->sampleRate - targetRate) < 0.5) {
+                if (! needsCopy (file))
+                    return;
+
+                targetRate = 0.0;
+            }
+
+            const auto copy = getCopyFile (engine, file, targetRate);
+
+            if (copy.existsAsFile())
+                return;
+
+            const auto partial = copy.withFileExtension ("partial");
+            copy.getParentDirectory().createDirectory();
+            partial.deleteFile();
+
+            // Lossy sources have nothing below 24 bits worth keeping.
+            const double outputRate = targetRate > 0.0 ? targetRate : reader->sampleRate;
+            std::unique_ptr<AudioFormatWriter> writer (formats.getWavFormat()->createWriterFor (partial.createOutputStream().release(),
+                                                                                                outputRate, reader->numChannels, 24, {}, 0));
+
+            if (writer == nullptr)
+                return;
+
+            const bool completed = targetRate > 0.0 ? writeConverted (*reader, *writer) : writeCopy (*reader, *writer);
+            writer.reset();
+
+            if (completed && partial.moveFileTo (copy)) {
+                prune();
+
+                MessageManager::callAsync ([weakThis = WeakReference<Builder> (this), source = file, copy] {
+                    if (weakThis != nullptr && weakThis->onCopyReady != nullptr)
+                        weakThis->onCopyReady (source, copy);
+                });
+            }
+            else {
+                partial.deleteFile();
+            }
+        }
+
+        static constexpr int blockSize = 1 << 16;
+
+        bool writeCopy (AudioFormatReader& reader, AudioFormatWriter& writer) {
+            for (int64 pos = 0; pos < reader.lengthInSamples; pos += blockSize) {
+                const int n = (int) jmin ((int64) blockSize, reader.lengthInSamples - pos);
+
+                if (threadShouldExit() || ! writer.writeFromAudioReader (reader, pos, n))
+                    return false;
+            }
+
+            return true;
+        }
+
+        bool writeConverted (AudioFormatReader& reader, AudioFormatWriter& writer) {
+            const int channels = (int) reader.numChannels;
+            const double ratio = reader.sampleRate / targetRate;
+            const auto length = (int64) std::llround (reader.lengthInSamples / ratio);
+
+            AudioFormatReaderSource readerSource (&reader, false);
+            Resampling::Source converter (&readerSource, channels, Resampling::getQuality (engine));
+            converter.setResamplingRatio (ratio);
+            converter.prepareToPlay (blockSize, targetRate);
+
+            AudioBuffer<float> block (channels, blockSize);
+
+            for (int64 pos = 0; pos < length; pos += blockSize) {
+                const int n = (int) jmin ((int64) blockSize, length - pos);
+                converter.getNextAudioBlock (AudioSourceChannelInfo (&block, 0, n));
+
+                if (threadShouldExit() || ! writer.writeFromAudioSampleBuffer (block, 0, n))
+                    return false;
+            }
+
+            return true;
+        }
+
+        // Deletes the least recently written copies until the folder fits in maxCacheBytes.
+        void prune() {
+            auto copies = getFolder (engine).findChildFiles (File::findFiles, false, "*.wav");
+            std::sort (copies.begin(), copies.end(), [] (const File& a, const File& b) {
+                return a.getLastModificationTime() > b.getLastModificationTime();
+            });
+
+            int64 total = 0;
+
+            for (auto& f : copies) {
+                total += f.getSize();
+
+                if (total > maxCacheBytes)
+                    f.deleteFile();
+            }
+        }
+
+        JUCE_DECLARE_WEAK_REFERENCEABLE (Builder)
+        JUCE_DECLARE_NON_COPYABLE (Builder)
+    };
+}
+//==============================================================================
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+namespace te = tracktion_engine;
+
+//==============================================================================
+/**
+        Saves and restores the session between launches.
+
+        The whole Edit state is kept, not just a list of settings: it already holds the file, the
+        "semitones up" value, the loop range, the transport position and the clip's stretch mode.
+        Keeping the Edit's ID also keeps its temp directory, so the proxies rendered for the
+        file last time are found again and playback is ready without re-preparing anything.
+*/
+//==============================================================================
+namespace Session {
+
+    // Returns the file the session is stored in.
+    static inline File getSessionFile() {
+        return File::getSpecialLocation (File::userApplicationDataDirectory)
+                   .getChildFile (ProjectInfo::projectName)
+                   .getChildFile ("session.tracktionedit");
+    }
+
+    // Returns the saved Edit state, or a new empty Edit if there is no usable saved session.
+    static inline ValueTree loadEditState (te::Engine& engine) {
+        if (auto xml = parseXML (getSessionFile())) {
+            auto state = ValueTree::fromXml (*xml);
+
+            if (state.hasType (te::IDs::EDIT))
+                return te::updateLegacyEdit (state);
+        }
+
+        return te::createEmptyEdit (engine);
+    }
+
+    // Writes the Edit state so the next launch can pick up where this one stopped. Returns true on success.
+    static inline bool save (te::Edit& edit) {
+        auto f = getSessionFile();
+
+        if (! f.getParentDirectory().createDirectory())
+            return false;
+
+        edit.flushState();
+
+        if (auto xml = edit.state.createXml())
+            return xml->writeTo (f);
+
+        return false;
+    }
+
+    // Removes the saved session, so the next launch starts empty.
+    static inline void clear() {
+        getSessionFile().deleteFile();
+    }
+}
+//==============================================================================
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "AppSettings.h"
+
+//==============================================================================
+/**
+    Optional single-instance mode.
+
+    The first instance listens on a loopback socket. A later launch connects, sends its file
+    arguments and quits before it ever creates a te::Engine or opens the audio device, and the
+    running instance loads the files itself. This is done here rather than through
+    moreThanOneInstanceAllowed() because JUCE can't forward command lines between instances on Linux.
+*/
+//==============================================================================
+class SingleInstance  : private InterprocessConnectionServer {
+public:
+
+    // Called on the message thread with the arguments of each later launch (possibly empty).
+    using ArgumentsCallback = std::function<void (const StringArray&)>;
+
+    SingleInstance (ArgumentsCallback callback)
+        : onArgumentsReceived (std::move (callback)) {
+    }
+
+    ~SingleInstance() override {
+        stop();
+        connections.clear();
+    }
+
+    // Starts accepting handoffs from later launches. Returns false if another instance already owns the socket.
+    bool startListening() {
+        return beginWaitingForSocket (getPort(), "127.0.0.1");
+    }
+
+    // Sends the arguments to a running instance. Returns true if one received them, in which case this launch should quit.
+    static bool forwardToRunningInstance (const StringArray& args) {
+        Client client;
+
+        if (! client.connectToSocket ("127.0.0.1", getPort(), 500))
+            return false;
+
+        const auto text = args.joinIntoString ("\n");
+        return client.sendMessage (MemoryBlock (text.toRawUTF8(), text.getNumBytesAsUTF8()));
+    }
+
+    //==============================================================================
+    // Returns true if single-instance mode is switched on in the app settings.
+    static bool isEnabled() {
+        return (bool) AppSettings().get ("singleInstance");
+    }
+
+    // Switches single-instance mode on or off for future launches.
+    static void setEnabled (bool shouldBeEnabled) {
+        AppSettings().set ("singleInstance", shouldBeEnabled);
+    }
+
+private:
+    static constexpr uint32 magicHeader = 0xa9011011;
+
+    ArgumentsCallback onArgumentsReceived;
+
+    // The port is fixed per application name so every launch agrees on it.
+    static int getPort() {
+        return 49152 + (int) ((uint32) String (ProjectInfo::projectName).hashCode() % 10000u);
+    }
+
+    //==============================================================================
+    struct Client  : public InterprocessConnection {
+        Client() : InterprocessConnection (false, magicHeader) {}
+        ~Client() override { disconnect(); }
+
+        void connectionMade() override {}
+        void connectionLost() override {}
+        void messageReceived (const MemoryBlock&) override {}
+    };
+
+    struct Connection  : public InterprocessConnection {
+        Connection (SingleInstance& o) : InterprocessConnection (true, magicHeader), owner (o) {}
+        ~Connection() override { disconnect(); }
+
+        void connectionMade() override {}
+        void connectionLost() override { lost = true; }
+
+        void messageReceived (const MemoryBlock& message) override {
+            StringArray args;
+            args.addLines (message.toString());
+            args.removeEmptyStrings();
+
+            if (owner.onArgumentsReceived != nullptr)
+                owner.onArgumentsReceived (args);
+        }
+
+        SingleInstance& owner;
+        std::atomic<bool> lost { false };
+    };
+
+    OwnedArray<Connection> connections;
+
+    InterprocessConnection* createConnectionObject() override {
+        // Connections from earlier launches are finished with by now.
+        for (int i = connections.size(); --i >= 0;)
+            if (connections.getUnchecked (i)->lost)
+                connections.remove (i);
+
+        return connections.add (new Connection (*this));
+    }
+};
+//==============================================================================
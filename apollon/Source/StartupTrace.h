@@ -0,0 +1,49 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+//==============================================================================
+/**
+        Timestamps for the phases of start-up, measured from when the process was loaded.
+        Each phase is logged as it's reached, and the milestones are summarised once the app is ready to play.
+*/
+//==============================================================================
+namespace StartupTrace {
+
+    // Taken during static initialisation, i.e. before main() runs.
+    inline const double processStartMs = Time::getMillisecondCounterHiRes();
+
+    struct Phase {
+        String name;
+        double ms;
+    };
+
+    inline Array<Phase> phases;
+
+    // Returns the milliseconds since the process was loaded.
+    static inline double now() {
+        return Time::getMillisecondCounterHiRes() - processStartMs;
+    }
+
+    // Records and logs that a phase has been reached.
+    static inline void mark (const String& phase) {
+        phases.add ({ phase, now() });
+        Logger::writeToLog ("[startup] " + String (phases.getLast().ms, 1) + " ms  " + phase);
+    }
+
+    // Returns when the named phase was reached, or a negative value if it hasn't been.
+    static inline double getTime (const String& phase) {
+        for (auto& p : phases)
+            if (p.name == phase)
+                return p.ms;
+
+        return -1.0;
+    }
+
+    // Logs the launch-to-first-frame and launch-to-ready times.
+    static inline void report() {
+        Logger::writeToLog ("[startup] first frame after " + String (getTime ("first frame"), 1) + " ms, ready to play after "
+                              + String (getTime ("ready to play"), 1) + " ms");
+    }
+}
+//==============================================================================
@@ -0,0 +1,263 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "AppSettings.h"
+
+#if JUCE_LINUX
+ #include <pthread.h>
+ #include <sched.h>
+#endif
+
+namespace te = tracktion_engine;
+
+//==============================================================================
+/**
+    Core isolation and real-time scheduling for the threads that produce audio.
+
+    Audio threads (the device callback, the graph workers running our plugins and the render-ahead
+    producer) can be pinned to a set of cores and given SCHED_FIFO or SCHED_RR priority. Background
+    threads (waveform scans, exports, offline renders) are kept on the remaining cores, so they
+    never compete with the stretcher.
+
+    The graph's worker threads are created inside tracktion, so nothing here is told about them.
+    Instead each audio thread applies the policy to itself the first time it runs one of our hooks
+    after the policy changes, which costs one atomic load on every other call. Whether each request
+    was granted is counted and reported on the message thread.
+
+    Only Linux can pin threads or change their scheduling class this way, elsewhere the settings
+    are stored but reported as unsupported. Cores above 63 can't be chosen.
+*/
+//==============================================================================
+namespace ThreadPolicy {
+
+    struct Settings {
+        Array<int> audioCores;      // Cores for the audio threads, empty leaves affinity alone.
+        int priority = 0;           // 1 to 99 asks for real-time scheduling, 0 leaves scheduling alone.
+        bool roundRobin = false;    // SCHED_RR rather than SCHED_FIFO.
+
+        // Reads the settings from the app settings.
+        static Settings load (const AppSettings& storage) {
+            Settings s;
+            s.audioCores = parseCores (storage.get ("audioThreadCores").toString());
+            s.priority = jlimit (0, 99, (int) storage.get ("audioThreadPriority"));
+            s.roundRobin = storage.get ("audioThreadPolicy").toString() == "rr";
+            return s;
+        }
+
+        // Stores the settings for this and future launches.
+        void save (AppSettings storage) const {
+            storage.set ("audioThreadCores", formatCores (audioCores));
+            storage.set ("audioThreadPriority", priority);
+            storage.set ("audioThreadPolicy", roundRobin ? "rr" : "fifo");
+        }
+
+        String describe() const {
+            return "audio threads on " + (audioCores.isEmpty() ? String ("any core") : "cores " + formatCores (audioCores))
+                     + ", " + (priority > 0 ? String (roundRobin ? "SCHED_RR " : "SCHED_FIFO ") + String (priority)
+                                            : String ("default scheduling"));
+        }
+
+        // Parses a core list such as "2,3" or "4-7".
+        static Array<int> parseCores (const String& text) {
+            Array<int> cores;
+
+            for (auto& token : StringArray::fromTokens (text, ",", {})) {
+                const auto first = token.upToFirstOccurrenceOf ("-", false, false).trim();
+                const auto last = token.fromFirstOccurrenceOf ("-", false, false).trim();
+
+                if (! first.containsOnly ("0123456789") || first.isEmpty())
+                    continue;
+
+                const int end = last.isNotEmpty() && last.containsOnly ("0123456789") ? last.getIntValue() : first.getIntValue();
+
+                for (int core = first.getIntValue(); core <= jmin (end, 63); ++core)
+                    cores.addIfNotAlreadyThere (core);
+            }
+
+            cores.sort();
+            return cores;
+        }
+
+        static String formatCores (const Array<int>& cores) {
+            StringArray s;
+
+            for (auto core : cores)
+                s.add (String (core));
+
+            return s.joinIntoString (",");
+        }
+    };
+
+    //==============================================================================
+    // The policy in force, written on the message thread and read by the threads applying it.
+    inline std::atomic<uint64> audioMask { 0 };
+    inline std::atomic<int> priority { 0 }, generation { 0 };
+    inline std::atomic<bool> roundRobin { false };
+
+    // What happened when the threads applied it, counted since the policy last changed.
+    inline std::atomic<int> numAudioThreads { 0 }, numBackgroundThreads { 0 };
+    inline std::atomic<int> numPriorityGranted { 0 }, numPriorityDenied { 0 }, numAffinityDenied { 0 };
+    inline std::atomic<int> lastError { 0 };
+
+    inline thread_local int appliedGeneration = 0;
+
+    // Returns true if this platform can apply the policy.
+    constexpr bool isSupported() noexcept {
+       #if JUCE_LINUX
+        return true;
+       #else
+        return false;
+       #endif
+    }
+
+    // Publishes new settings. Each thread picks them up the next time it applies the policy.
+    inline void configure (const Settings& s) {
+        uint64 mask = 0;
+
+        for (auto core : s.audioCores)
+            if (isPositiveAndBelow (core, 64))
+                mask |= (uint64) 1 << core;
+
+        audioMask = mask;
+        priority = jlimit (0, 99, s.priority);
+        roundRobin = s.roundRobin;
+
+        numAudioThreads = numBackgroundThreads = 0;
+        numPriorityGranted = numPriorityDenied = numAffinityDenied = 0;
+        lastError = 0;
+
+        generation.fetch_add (1, std::memory_order_release);
+    }
+
+   #if JUCE_LINUX
+    // Pins the calling thread to the cores in the mask. Returns false if that was refused.
+    inline bool pinCurrentThread (uint64 mask) noexcept {
+        cpu_set_t set;
+        CPU_ZERO (&set);
+
+        for (int core = 0; core < 64; ++core)
+            if ((mask >> core) & 1)
+                CPU_SET (core, &set);
+
+        const int error = pthread_setaffinity_np (pthread_self(), sizeof (set), &set);
+
+        if (error != 0)
+            lastError = error;
+
+        return error == 0;
+    }
+   #endif
+
+    // Applies the audio-thread policy to the calling thread, if it has changed since this thread last did.
+    // Call it at the top of every audio hook, before any RealtimeGuard::ScopedAudioThread: changing
+    // the policy makes a system call, once. Threads that aren't driven by the device can take the
+    // cores without the priority, so they can never starve the callback.
+    inline void applyToAudioThread (bool raisePriority = true) noexcept {
+        const int current = generation.load (std::memory_order_acquire);
+
+        if (current == appliedGeneration)
+            return;
+
+        appliedGeneration = current;
+
+       #if JUCE_LINUX
+        if (const auto mask = audioMask.load(); mask != 0 && ! pinCurrentThread (mask))
+            ++numAffinityDenied;
+
+        if (const int p = priority.load(); p > 0 && raisePriority) {
+            sched_param param {};
+            param.sched_priority = p;
+
+            if (const int error = pthread_setschedparam (pthread_self(), roundRobin.load() ? SCHED_RR : SCHED_FIFO, &param); error == 0) {
+                ++numPriorityGranted;
+            }
+            else {
+                ++numPriorityDenied;
+                lastError = error;
+            }
+        }
+
+        ++numAudioThreads;
+       #endif
+    }
+
+    // Keeps the calling thread off the audio cores. Call it at the start of background threads and jobs.
+    inline void applyToBackgroundThread() noexcept {
+        const int current = generation.load (std::memory_order_acquire);
+
+        if (current == appliedGeneration)
+            return;
+
+        appliedGeneration = current;
+
+       #if JUCE_LINUX
+        const auto mask = audioMask.load();
+        const int numCores = jmin (64, SystemStats::getNumCpus());
+        const auto allCores = numCores >= 64 ? ~(uint64) 0 : ((uint64) 1 << numCores) - 1;
+
+        // Nowhere left to go if the audio threads have every core.
+        if (mask == 0 || (allCores & ~mask) == 0)
+            return;
+
+        if (pinCurrentThread (allCores & ~mask))
+            ++numBackgroundThreads;
+        else
+            ++numAffinityDenied;
+       #endif
+    }
+
+    // Describes what was asked for and what was granted so far.
+    inline String getReport() {
+        if (! isSupported())
+            return "thread policy isn't supported on this platform";
+
+        String report;
+        report << numAudioThreads.load() << " audio, " << numBackgroundThreads.load() << " background thread(s) configured";
+
+        if (priority.load() > 0)
+            report << ", priority granted on " << numPriorityGranted.load() << ", denied on " << numPriorityDenied.load();
+
+        if (numAffinityDenied.load() > 0)
+            report << ", pinning denied on " << numAffinityDenied.load();
+
+        if (const int error = lastError.load(); error != 0)
+            report << " (" << String (strerror (error))
+                   << (error == EPERM ? ", raise rtprio in limits.conf or grant CAP_SYS_NICE" : "") << ")";
+
+        return report;
+    }
+
+    //==============================================================================
+    // Logs the outcome as it changes, so a denied request shows up without opening the HUD. It only
+    // watches until the audio threads have been configured, or for a minute if no device starts,
+    // after which the HUD is the place to look.
+    class Reporter  : private Timer {
+    public:
+        Reporter (const Settings& s)
+            : settings (s) {
+            configure (settings);
+            Logger::writeToLog ("[threads] requested " + settings.describe());
+            startTimer (1000);
+        }
+
+    private:
+        Settings settings;
+        String lastReport;
+        int ticks = 0;
+
+        static constexpr int maxTicks = 60;
+
+        void timerCallback() override {
+            const auto report = getReport();
+
+            if (report != lastReport)
+                Logger::writeToLog ("[threads] " + report);
+
+            lastReport = report;
+
+            if (numAudioThreads.load() > 0 || ++ticks >= maxTicks)
+                stopTimer();
+        }
+    };
+}
+//==============================================================================
@@ -0,0 +1,261 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "RealtimeGuard.h"
+#include "ThreadPolicy.h"
+
+namespace te = tracktion_engine;
+
+// Set to 0 to compile every trace zone out completely.
+#ifndef APOLLON_TRACING
+ #define APOLLON_TRACING 1
+#endif
+
+//==============================================================================
+/**
+    Scoped trace zones recorded into per-thread ring buffers, dumped on demand as Chrome trace
+    JSON (which Perfetto also opens).
+
+    Each thread claims one buffer from a pool allocated when tracing is first switched on, so
+    recording never allocates or locks and is safe on the audio thread. The pool is published
+    through an atomic pointer and then kept until exit, so a thread that sees it sees it whole. Only the owning thread writes to a
+    buffer; the dump reads behind it and skips anything that may have been overwritten meanwhile.
+    When tracing is off a zone costs a single relaxed atomic load.
+*/
+//==============================================================================
+namespace Tracing {
+
+    struct Event {
+        const char* name;  // Must be a string literal, only the pointer is stored.
+        int64 startTicks, endTicks;
+    };
+
+    struct ThreadBuffer {
+        static constexpr uint64 capacity = 1 << 14;
+
+        std::unique_ptr<Event[]> events { new Event[capacity] };
+        std::atomic<uint64> written { 0 };
+        std::atomic<uint64> threadId { 0 };
+        char threadName[32] {};
+
+        void push (const char* name, int64 start, int64 end) noexcept {
+            const auto i = written.load (std::memory_order_relaxed);
+            events[i & (capacity - 1)] = { name, start, end };
+            written.store (i + 1, std::memory_order_release);
+        }
+    };
+
+    class Recorder {
+    public:
+        static Recorder& getInstance() {
+            static Recorder instance;
+            return instance;
+        }
+
+        static constexpr int maxThreads = 64;
+
+        // Allocates the buffers on first use and starts recording.
+        void setEnabled (bool shouldBeEnabled) {
+            if (shouldBeEnabled && buffers.load (std::memory_order_acquire) == nullptr) {
+                auto* pool = new ThreadBuffer[maxThreads];
+                ThreadBuffer* expected = nullptr;
+
+                // Someone else got there first, so theirs is the pool.
+                if (! buffers.compare_exchange_strong (expected, pool, std::memory_order_acq_rel))
+                    delete[] pool;
+            }
+
+            enabled.store (shouldBeEnabled, std::memory_order_release);
+        }
+
+        bool isEnabled() const noexcept {
+            return enabled.load (std::memory_order_relaxed);
+        }
+
+        // Records a finished zone on the calling thread. Dropped if every buffer has been claimed.
+        void record (const char* name, int64 startTicks, int64 endTicks) noexcept {
+            if (auto* b = getBufferForThisThread())
+                b->push (name, startTicks, endTicks);
+        }
+
+        // Writes everything currently held in the buffers to a Chrome trace JSON file.
+        bool dump (const File& file) const {
+            FileOutputStream out (file);
+            auto* pool = buffers.load (std::memory_order_acquire);
+
+            if (! out.openedOk() || pool == nullptr)
+                return false;
+
+            out.setPosition (0);
+            out.truncate();
+
+            const double ticksToMicros = 1.0e6 / (double) Time::getHighResolutionTicksPerSecond();
+            const int64 origin = originTicks;
+            const int numThreads = jmin (maxThreads, claimed.load());
+            bool first = true;
+
+            out << "{\"traceEvents\":[\n";
+
+            auto separator = [&] { if (! first) out << ",\n"; first = false; };
+
+            for (int t = 0; t < numThreads; ++t) {
+                auto& b = pool[t];
+                const auto tid = (int64) b.threadId.load();
+
+                separator();
+                out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << tid
+                    << ",\"args\":{\"name\":" << JSON::toString (String (b.threadName)) << "}}";
+
+                const auto end = b.written.load (std::memory_order_acquire);
+                const auto start = end > ThreadBuffer::capacity ? end - ThreadBuffer::capacity : 0;
+
+                for (auto i = start; i < end; ++i) {
+                    const auto e = b.events[i & (ThreadBuffer::capacity - 1)];
+
+                    // The owning thread may have lapped us while we were reading, skip anything it could have overwritten.
+                    if (b.written.load (std::memory_order_acquire) - i > ThreadBuffer::capacity)
+                        continue;
+
+                    separator();
+                    out << "{\"name\":" << JSON::toString (String (e.name)) << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << tid
+                        << ",\"ts\":" << String ((double) (e.startTicks - origin) * ticksToMicros, 3)
+                        << ",\"dur\":" << String ((double) (e.endTicks - e.startTicks) * ticksToMicros, 3) << "}";
+                }
+            }
+
+            out << "\n]}\n";
+            return true;
+        }
+
+    private:
+        Recorder() = default;
+
+        ~Recorder() {
+            delete[] buffers.load();
+        }
+
+        std::atomic<bool> enabled { false };
+        std::atomic<ThreadBuffer*> buffers { nullptr };
+        std::atomic<int> claimed { 0 };
+        const int64 originTicks = Time::getHighResolutionTicks();
+
+        ThreadBuffer* getBufferForThisThread() noexcept {
+            thread_local ThreadBuffer* buffer = nullptr;
+
+            if (buffer != nullptr)
+                return buffer;
+
+            if (auto* pool = buffers.load (std::memory_order_acquire)) {
+                const int index = claimed.fetch_add (1);
+
+                if (index >= maxThreads)
+                    return nullptr;
+
+                buffer = &pool[index];
+                buffer->threadId = (uint64) (pointer_sized_int) Thread::getCurrentThreadId();
+
+                // Thread::getCurrentThreadName allocates, so name the slot without it.
+                if (auto* t = Thread::getCurrentThread())
+                    t->getThreadName().copyToUTF8 (buffer->threadName, sizeof (buffer->threadName));
+                else if (MessageManager::getInstanceWithoutCreating() != nullptr
+                          && MessageManager::getInstanceWithoutCreating()->isThisTheMessageThread())
+                    String ("Message thread").copyToUTF8 (buffer->threadName, sizeof (buffer->threadName));
+                else
+                    std::snprintf (buffer->threadName, sizeof (buffer->threadName), "Audio thread %d", index);
+            }
+
+            return buffer;
+        }
+    };
+
+    //==============================================================================
+    // Records the lifetime of the object as a zone, if tracing was on when it was created.
+    struct ScopedZone {
+        explicit ScopedZone (const char* zoneName) noexcept
+            : name (Recorder::getInstance().isEnabled() ? zoneName : nullptr),
+              start (name != nullptr ? Time::getHighResolutionTicks() : 0) {
+        }
+
+        ~ScopedZone() noexcept {
+            if (name != nullptr)
+                Recorder::getInstance().record (name, start, Time::getHighResolutionTicks());
+        }
+
+        const char* const name;
+        const int64 start;
+
+        JUCE_DECLARE_NON_COPYABLE (ScopedZone)
+    };
+
+    //==============================================================================
+    /**
+        Wraps the engine's audio device callback so each device callback is recorded as a zone,
+        and publishes how much of the block's duration the callback took.
+        tracktion's DeviceManager inherits AudioIODeviceCallback privately, so the C-style cast
+        below is the only way to reach it.
+    */
+    class CallbackZone  : public AudioIODeviceCallback {
+    public:
+        explicit CallbackZone (te::Engine& e)
+            : engine (e), inner ((AudioIODeviceCallback*) &e.getDeviceManager()) {
+            auto& dm = engine.getDeviceManager().deviceManager;
+            dm.removeAudioCallback (inner);
+            dm.addAudioCallback (this);
+        }
+
+        ~CallbackZone() override {
+            auto& dm = engine.getDeviceManager().deviceManager;
+            dm.removeAudioCallback (this);
+            dm.addAudioCallback (inner);
+        }
+
+        void audioDeviceIOCallback (const float** inputChannelData, int numInputChannels,
+                                    float** outputChannelData, int numOutputChannels, int numSamples) override {
+            ThreadPolicy::applyToAudioThread();
+            const auto start = Time::getHighResolutionTicks();
+
+            {
+                RealtimeGuard::ScopedAudioThread audioThread;
+                ScopedZone zone ("audio callback");
+                inner->audioDeviceIOCallback (inputChannelData, numInputChannels, outputChannelData, numOutputChannels, numSamples);
+            }
+
+            const auto elapsed = Time::highResolutionTicksToSeconds (Time::getHighResolutionTicks() - start);
+            const auto load = (float) (elapsed * sampleRate.load (std::memory_order_relaxed) / jmax (1, numSamples));
+
+            lastLoad.store (load, std::memory_order_relaxed);
+
+            auto peak = peakLoad.load (std::memory_order_relaxed);
+            while (load > peak && ! peakLoad.compare_exchange_weak (peak, load, std::memory_order_relaxed)) {}
+        }
+
+        void audioDeviceAboutToStart (AudioIODevice* device) override {
+            sampleRate = device->getCurrentSampleRate();
+            inner->audioDeviceAboutToStart (device);
+        }
+
+        void audioDeviceStopped() override                              { inner->audioDeviceStopped(); }
+        void audioDeviceError (const String& message) override          { inner->audioDeviceError (message); }
+
+        // Returns the fraction of the last block's duration spent in the callback.
+        float getLoad() const noexcept            { return lastLoad.load (std::memory_order_relaxed); }
+
+        // Returns the highest load since the last call, then resets it.
+        float getAndResetPeakLoad() noexcept      { return peakLoad.exchange (0.0f, std::memory_order_relaxed); }
+
+    private:
+        te::Engine& engine;
+        AudioIODeviceCallback* inner;
+        std::atomic<double> sampleRate { 44100.0 };
+        std::atomic<float> lastLoad { 0.0f }, peakLoad { 0.0f };
+    };
+}
+
+#if APOLLON_TRACING
+ #define APOLLON_TRACE_JOIN_INNER(a, b) a##b
+ #define APOLLON_TRACE_JOIN(a, b) APOLLON_TRACE_JOIN_INNER (a, b)
+ #define APOLLON_TRACE_ZONE(name) Tracing::ScopedZone APOLLON_TRACE_JOIN (traceZone_, __LINE__) (name)
+#else
+ #define APOLLON_TRACE_ZONE(name)
+#endif
+//==============================================================================
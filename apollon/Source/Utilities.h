@@ -8,6 +8,11 @@
 
 #pragma once
 
+#include "Tracing.h"
+#include "PerformanceHud.h"
+#include "Playhead.h"
+#include "LargeFile.h"
+
 namespace te = tracktion_engine;
 
 //==============================================================================
@@ -62,6 +67,8 @@ namespace Helpers {
 
     // Loads an audio file into the given edit.
     te::WaveAudioClip::Ptr loadAudioFileAsClip (te::Edit& edit, const File& file) {
+        APOLLON_TRACE_ZONE ("Helpers::loadAudioFileAsClip");
+        
         // Find the first track and delete all clips from it.
         if (auto track = getOrInsertAudioTrackAt (edit, 0)) {
             
@@ -82,6 +89,13 @@ namespace Helpers {
         return {};
     }
 
+    // Sets up a freshly loaded clip the way the pitch chain expects it: no tempo or pitch following, so only the plugin transposes.
+    void preparePitchShiftClip (te::WaveAudioClip& clip) {
+        clip.setAutoTempo (false);
+        clip.setAutoPitch (false);
+        clip.setTimeStretchMode (te::TimeStretcher::melodyne);
+    }
+
     // Configures the audio file to loop.
     template<typename ClipType>
     typename ClipType::Ptr loopAroundClip (ClipType& clip) {
@@ -101,7 +115,62 @@ namespace Helpers {
         // If its playing pause, if not play.
         transport.isPlaying() ? transport.stop (false, false) : transport.play (false);
     }
-        
+
+    // Routes every audio input into the given track and monitors it through the track's plugins, or stops monitoring it.
+    void routeAudioInputsToTrack (te::Edit& edit, te::AudioTrack& track, bool shouldMonitor) {
+        auto& dm = edit.engine.getDeviceManager();
+
+        for (int i = 0; i < dm.getNumWaveInDevices(); ++i) {
+            if (auto dev = dm.getWaveInDevice (i)) {
+                if (shouldMonitor)
+                    dev->setEnabled (true);
+
+                dev->setEndToEndEnabled (shouldMonitor);
+            }
+        }
+
+        // Input is heard while stopped too, there is no clip to play in live mode.
+        edit.playInStopEnabled = true;
+        edit.getTransport().ensureContextAllocated (true);
+
+        for (auto instance : edit.getAllInputDevices()) {
+            if (instance->getInputDevice().getDeviceType() == te::InputDevice::waveDevice) {
+                if (shouldMonitor) {
+                    instance->setTargetTrack (track, 0, true);
+                    instance->setRecordingEnabled (track, false);
+                }
+                else {
+                    instance->removeTargetTrack (track);
+                }
+            }
+        }
+    }
+
+    // Enables every MIDI input and routes it into the given track, so its plugins receive the messages timestamped inside each audio block.
+    void routeMidiInputsToTrack (te::Edit& edit, te::AudioTrack& track) {
+        auto& dm = edit.engine.getDeviceManager();
+
+        for (int i = 0; i < dm.getNumMidiInDevices(); ++i) {
+            if (auto dev = dm.getMidiInDevice (i)) {
+                dev->setEnabled (true);
+                dev->setEndToEndEnabled (true);
+            }
+        }
+
+        // Keep MIDI flowing while stopped so transport messages can start playback.
+        edit.playInStopEnabled = true;
+        edit.getTransport().ensureContextAllocated (true);
+
+        for (auto instance : edit.getAllInputDevices()) {
+            if (instance->getInputDevice().getDeviceType() == te::InputDevice::physicalMidiDevice) {
+                instance->setTargetTrack (track, 0, true);
+                instance->setRecordingEnabled (track, false);
+            }
+        }
+
+        edit.restartPlayback();
+    }
+
 
 
 }
@@ -117,32 +186,92 @@ struct Thumbnail    : public Component {
         cursorUpdater.setCallback ([this]
                                    {
                                        updateCursorPosition();
-                                       if (smartThumbnail.isGeneratingProxy() || smartThumbnail.isOutOfDate())
+                                       tracePeaksScan();
+                                       
+                                       // Once the thumbnail is ready the streamed peaks aren't shown any more, so don't keep decoding them.
+                                       if (! usingStreamingPeaks && ! smartThumbnail.isGeneratingProxy() && streamingPeaks.isScanning())
+                                           streamingPeaks.clear();
+                                       
+                                       // Keep repainting while peaks stream in, plus once more to show the last of them.
+                                       const bool scanning = streamingPeaks.isScanning();
+
+                                       if (smartThumbnail.isGeneratingProxy() || smartThumbnail.isOutOfDate() || scanning || peaksWereScanning)
                                            repaint();
+
+                                       peaksWereScanning = scanning;
+
+                                       // Nothing is moving any more, so stop waking up until something does.
+                                       if (! needsUpdates())
+                                           cursorUpdater.stopTimer();
                                    });
         cursor.setFill (juce::Colours::orange);
         
         addAndMakeVisible (cursor);
     }
 
-    void setFile (const te::AudioFile& file) {
-        smartThumbnail.setNewFile (file);
-        cursorUpdater.startTimerHz (25);
+    // Files at least this long are only ever drawn from streamed peaks, so memory doesn't grow with their length.
+    static constexpr double largeFileSeconds = 30.0 * 60.0;
+
+    // Shows the clip's playback file. The streamed peaks are read from source, the file the clip was loaded
+    // from, because the playback file may be a proxy that is still being written. Without a source they
+    // read the playback file.
+    void setFile (const te::AudioFile& file, const File& source = {}) {
+        const auto peaksFile = source.existsAsFile() ? source : file.getFile();
+        const te::AudioFile peaksAudioFile (transport.engine, peaksFile);
+        usingStreamingPeaks = peaksAudioFile.isValid() && peaksAudioFile.getLength() >= largeFileSeconds;
+
+        if (usingStreamingPeaks) {
+            smartThumbnail.setNewFile (te::AudioFile (transport.engine));
+            startPeaksScan (peaksFile);
+        }
+        else {
+            smartThumbnail.setNewFile (file);
+
+            // While the thumbnail is built and cached for next time, the streamed peaks fill in across every
+            // core. They're dropped as soon as it's ready, so the file is only decoded twice until then.
+            if (smartThumbnail.isGeneratingProxy())
+                startPeaksScan (peaksFile);
+            else
+                streamingPeaks.clear();
+        }
+
         cursor.setVisible(true);
+        transportStateChanged();
         repaint();
     }
 
+    // Called when the transport starts, stops or jumps. Runs the cursor timer only while there is something to follow.
+    void transportStateChanged() {
+        updateCursorPosition();
+
+        if (needsUpdates())
+            cursorUpdater.startTimerHz (60);
+    }
+
+    // Follows the position the audio thread publishes instead of polling the transport, and asks
+    // the plugin for its latency so the cursor shows what is being heard rather than what is being processed.
+    void setPlayheadSource (const PlayheadClock* clock, te::Plugin* latencySource) {
+        playheadClock = clock;
+        latencyPlugin = latencySource;
+    }
+
     void paint (Graphics& g) override {
+        APOLLON_TRACE_ZONE ("Thumbnail::paint");
+        UiTimings::ScopedTimer timer (UiTimings::get().framePaintMs);
         auto r = getLocalBounds();
 
         g.setColour(juce::Colours::darkgrey);
         g.fillRoundedRectangle(r.toFloat(), 10.0);
         
-        if (smartThumbnail.isGeneratingProxy()) {
-            g.setColour (juce::Colours::grey);
-            g.drawText ("Loading File: " + String (roundToInt (smartThumbnail.getProxyProgress() * 100.0f)) + "%",
-                        r, Justification::centred);
+        if (usingStreamingPeaks || smartThumbnail.isGeneratingProxy()) {
+            g.setColour (juce::Colours::white);
+            streamingPeaks.draw (g, r.reduced (0, 10));
 
+            // Only worth saying while there is little to see yet.
+            if (streamingPeaks.isScanning() && streamingPeaks.getProgress() < 0.5f) {
+                g.setColour (juce::Colours::grey);
+                g.drawText ("Loading File: " + String (roundToInt (streamingPeaks.getProgress() * 100.0f)) + "%", r, Justification::centred);
+            }
         }
         else {
             g.setColour (juce::Colours::white);
@@ -159,26 +288,94 @@ struct Thumbnail    : public Component {
         jassert (getWidth() > 0);
         const float proportion = e.position.x / getWidth();
         transport.position = proportion * transport.getLoopRange().getLength();
+        updateCursorPosition();
     }
 
     void mouseUp (const MouseEvent&) override {
         transport.setUserDragging (false);
+        transportStateChanged();
     }
     
     void clearFile () {
         smartThumbnail.file.deleteFile();
+        streamingPeaks.clear();
+        usingStreamingPeaks = false;
         cursor.setVisible(false);
     }
 
 private:
     te::TransportControl& transport;
     te::SmartThumbnail smartThumbnail { transport.engine, te::AudioFile (transport.engine), *this, nullptr };
+    StreamingPeaks streamingPeaks { transport.engine };
+    bool usingStreamingPeaks = false, peaksWereScanning = false;
     DrawableRectangle cursor;
     te::LambdaTimer cursorUpdater;
+    int64 scanStartTicks = 0;
+    const PlayheadClock* playheadClock = nullptr;
+    te::Plugin* latencyPlugin = nullptr;
+
+    void startPeaksScan (const File& f) {
+        streamingPeaks.setFile (f);
+        scanStartTicks = Tracing::Recorder::getInstance().isEnabled() ? Time::getHighResolutionTicks() : 0;
+    }
+
+    // Records the peaks scan started by the last setFile as one zone once it has finished, if tracing is still on.
+    void tracePeaksScan() {
+        if (scanStartTicks == 0 || streamingPeaks.isScanning())
+            return;
+
+        if (Tracing::Recorder::getInstance().isEnabled())
+            Tracing::Recorder::getInstance().record ("waveform peaks scan", scanStartTicks, Time::getHighResolutionTicks());
+
+        scanStartTicks = 0;
+    }
+
+    // Returns true while the cursor or the waveform can still change without any input.
+    bool needsUpdates() {
+        return transport.isPlaying() || scanStartTicks != 0 || streamingPeaks.isScanning() || peaksWereScanning
+                 || smartThumbnail.isGeneratingProxy() || smartThumbnail.isOutOfDate();
+    }
+
+    // Returns the seconds between a block being processed and it being heard: the device's output latency, the
+    // buffer queued ahead of it and the plugin's lookahead.
+    double getOutputLatencySeconds() {
+        double latency = latencyPlugin != nullptr ? latencyPlugin->getLatencySeconds() : 0.0;
+
+        if (auto device = transport.engine.getDeviceManager().deviceManager.getCurrentAudioDevice())
+            if (device->getCurrentSampleRate() > 0.0)
+                latency += (device->getOutputLatencyInSamples() + device->getCurrentBufferSizeSamples()) / device->getCurrentSampleRate();
+
+        return latency;
+    }
+
+    // Returns the position being heard now, extrapolated from the last block the audio thread published.
+    double getAudiblePosition() {
+        if (playheadClock == nullptr || ! transport.isPlaying() || transport.isUserDragging())
+            return transport.getCurrentPosition();
+
+        const auto published = playheadClock->getCurrentPosition();
+
+        if (! published.has_value())
+            return transport.getCurrentPosition();
+
+        auto position = *published - getOutputLatencySeconds();
+
+        // Just after a loop wrap the audible position is still at the end of the previous pass.
+        const auto loop = transport.getLoopRange();
+
+        if (transport.looping && loop.getLength() > 0.0) {
+            position = loop.getStart() + std::fmod (position - loop.getStart(), loop.getLength());
+
+            if (position < loop.getStart())
+                position += loop.getLength();
+        }
+
+        return position;
+    }
 
     void updateCursorPosition(){
         const double loopLength = transport.getLoopRange().getLength();
-        const double proportion = loopLength == 0.0 ? 0.0 : transport.getCurrentPosition() / loopLength;
+        const double proportion = loopLength == 0.0 ? 0.0 : getAudiblePosition() / loopLength;
 
         auto r = getLocalBounds().reduced(0,10).toFloat();
         const float x = r.getWidth() * float (proportion);
@@ -258,6 +455,7 @@ public:
     // Function to dictate the drawing of a slider
     void drawRotarySlider (Graphics& g, int x, int y, int width, int height, float sliderPos,
                                            const float rotaryStartAngle, const float rotaryEndAngle, Slider& slider) override {
+        UiTimings::ScopedTimer timer (UiTimings::get().frameRotaryMs);
         
         auto outline = juce::Colours::darkgrey;
         auto fill    = juce::Colours::black;